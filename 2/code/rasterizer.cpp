@@ -87,21 +87,34 @@ void Rasterizer::drawTriangle(const Triangle& t) {
 	auto l2 = Shader::Light{ {-20, 20, 0}, {500, 500, 500} };
 	vector<Shader::Light> lights = { l1, l2 };
 
+	EdgeFunctions e;
+	if (!edgeFunctions(vec_screen[0].head<2>(), vec_screen[1].head<2>(), vec_screen[2].head<2>(), e))
+		return;
+
+	// clamp to the screen, edge values are evaluated at pixel centers and stepped incrementally
+	minx = max(minx, 0);
+	maxx = min(maxx, width - 1);
+	miny = max(miny, 0);
+	maxy = min(maxy, height - 1);
+	int64_t w_row[3], step_x[3], step_y[3];
+	for (int i = 0; i < 3; i++) {
+		w_row[i] = e.a[i] * ((int64_t)minx * SUBPIXEL_ONE + SUBPIXEL_ONE / 2)
+			+ e.b[i] * ((int64_t)miny * SUBPIXEL_ONE + SUBPIXEL_ONE / 2) + e.c[i];
+		step_x[i] = e.a[i] * SUBPIXEL_ONE;
+		step_y[i] = e.b[i] * SUBPIXEL_ONE;
+	}
+
 	// run rasterizer
 	for (int y = miny; y <= maxy; y++) {
-		for (int x = minx; x <= maxx; x++) {
-			float px = x + 0.5;
-			float py = y + 0.5;
-			float alpha, beta, gamma;
-
-			barycentric(px, py,
-				Vec2(vec_screen[0].x(), vec_screen[0].y()),
-				Vec2(vec_screen[1].x(), vec_screen[1].y()),
-				Vec2(vec_screen[2].x(), vec_screen[2].y()),
-				alpha, beta, gamma);
-			if (alpha < 0 || beta < 0 || gamma < 0)
+		int64_t w0 = w_row[0], w1 = w_row[1], w2 = w_row[2];
+		for (int x = minx; x <= maxx; x++, w0 += step_x[0], w1 += step_x[1], w2 += step_x[2]) {
+			if ((w0 | w1 | w2) < 0) // outside if any edge value is negative
 				continue;
 
+			float alpha = (float)w0 * e.inv_area;
+			float beta = (float)w1 * e.inv_area;
+			float gamma = (float)w2 * e.inv_area;
+
 			float z_interpolated = alpha * vec_screen[0].z() + beta * vec_screen[1].z() + gamma * vec_screen[2].z();
 			int idx = (height - 1 - y) * width + x;
 			if (z_interpolated < depth_buffer[idx]) {
@@ -124,6 +137,9 @@ void Rasterizer::drawTriangle(const Triangle& t) {
 				pixel_buffer.at<cv::Vec3b>(y, x)[2] = (uchar)(shaded_color.x() * 255);
 			}
 		}
+
+		for (int i = 0; i < 3; i++)
+			w_row[i] += step_y[i];
 	}
 
 	return;
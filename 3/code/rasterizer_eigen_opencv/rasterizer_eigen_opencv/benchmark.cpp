@@ -0,0 +1,853 @@
+#include "benchmark.hpp"
+#include "geometry.hpp"
+#include "obj_reader.hpp"
+#include "mesh_cache.hpp"
+#include "OBJ_Loader.h"
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <iomanip>
+#include <thread>
+#include <vector>
+#include <random>
+#include <cmath>
+#include <algorithm>
+#include <array>
+#include <unordered_set>
+#include <filesystem>
+#include <fstream>
+#include <opencv2/opencv.hpp>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+static bool samePixels(const cv::Mat& a, const cv::Mat& b) {
+	if (a.rows != b.rows || a.cols != b.cols || a.type() != b.type())
+		return false;
+	for (int y = 0; y < a.rows; y++)
+		if (memcmp(a.ptr<uchar>(y), b.ptr<uchar>(y), a.cols * a.elemSize()) != 0)
+			return false;
+	return true;
+}
+
+// average wall time of one frame in milliseconds, last frame is returned in pixels
+static double timeFrames(Rasterizer& rasterizer, const function<void(Rasterizer&)>& draw_frame, int repeats, cv::Mat& pixels) {
+	auto start = chrono::steady_clock::now();
+	for (int i = 0; i < repeats; i++) {
+		rasterizer.clear();
+		draw_frame(rasterizer);
+		pixels = rasterizer.getPixels();
+	}
+	auto end = chrono::steady_clock::now();
+	return chrono::duration<double, milli>(end - start).count() / repeats;
+}
+
+void benchmarkThreadScaling(Rasterizer& rasterizer, const function<void(Rasterizer&)>& draw_frame, int repeats) {
+	int max_threads = max(1, (int)thread::hardware_concurrency());
+	vector<int> thread_counts;
+	for (int n = 1; n < max_threads; n *= 2)
+		thread_counts.push_back(n);
+	thread_counts.push_back(max_threads);
+
+	int old_thread_count = rasterizer.getThreadCount();
+	cv::Mat reference;
+	double single_ms = 0.0;
+
+	cout << "threads    frame (ms)    speedup    identical" << endl;
+	for (int n : thread_counts) {
+		rasterizer.setThreadCount(n);
+		cv::Mat pixels;
+		double ms = timeFrames(rasterizer, draw_frame, repeats, pixels);
+		if (n == 1) {
+			reference = pixels.clone();
+			single_ms = ms;
+		}
+		cout << setw(7) << n << setw(14) << fixed << setprecision(2) << ms
+			<< setw(10) << setprecision(2) << single_ms / ms << "x"
+			<< setw(13) << (samePixels(reference, pixels) ? "yes" : "NO") << endl;
+	}
+
+	rasterizer.setThreadCount(old_thread_count);
+}
+
+void benchmarkRasterKernels(Rasterizer& rasterizer, const vector<pair<string, function<void(Rasterizer&)>>>& scenes, int repeats) {
+	RasterKernel old_kernel = rasterizer.getRasterKernel();
+
+	cout << "scene     kernel    frame (ms)    speedup    identical" << endl;
+	for (const auto& [name, draw_frame] : scenes) {
+		cv::Mat reference;
+		double scalar_ms = 0.0;
+		for (RasterKernel kernel : { RasterKernel::Scalar, RasterKernel::SSE2, RasterKernel::AVX2 }) {
+			if (!rasterKernelSupported(kernel))
+				continue;
+			rasterizer.setRasterKernel(kernel);
+			cv::Mat pixels;
+			double ms = timeFrames(rasterizer, draw_frame, repeats, pixels);
+			if (kernel == RasterKernel::Scalar) {
+				reference = pixels.clone();
+				scalar_ms = ms;
+			}
+			cout << left << setw(8) << name << right << setw(8) << rasterKernelName(kernel) << setw(14) << fixed << setprecision(2) << ms
+				<< setw(10) << setprecision(2) << scalar_ms / ms << "x"
+				<< setw(13) << (samePixels(reference, pixels) ? "yes" : "NO") << endl;
+		}
+	}
+
+	rasterizer.setRasterKernel(old_kernel);
+}
+
+void benchmarkShadingModes(Rasterizer& rasterizer, const function<void(Rasterizer&)>& draw_frame, int repeats) {
+	const pair<Rasterizer::ShadingMode, const char*> modes[] = {
+		{ Rasterizer::ShadingMode::Forward, "forward" },
+		{ Rasterizer::ShadingMode::Deferred, "deferred" },
+		{ Rasterizer::ShadingMode::ZPrepass, "zprepass" }
+	};
+
+	Rasterizer::ShadingMode old_mode = rasterizer.getShadingMode();
+	cv::Mat reference;
+
+	cout << "mode        frame (ms)    shaded    overdraw    identical" << endl;
+	for (const auto& [mode, name] : modes) {
+		rasterizer.setShadingMode(mode);
+		cv::Mat pixels;
+		double ms = timeFrames(rasterizer, draw_frame, repeats, pixels);
+		if (reference.empty())
+			reference = pixels.clone();
+		Rasterizer::FrameStats stats = rasterizer.getFrameStats();
+		double overdraw = stats.pixels_covered > 0 ? (double)stats.fragments_shaded / stats.pixels_covered : 0.0;
+		cout << left << setw(8) << name << right << setw(14) << fixed << setprecision(2) << ms
+			<< setw(10) << stats.fragments_shaded << setw(11) << setprecision(2) << overdraw << "x"
+			<< setw(13) << (samePixels(reference, pixels) ? "yes" : "NO") << endl;
+	}
+
+	rasterizer.setShadingMode(old_mode);
+}
+
+// largest difference of one channel in 8-bit steps and the share of pixels that differ at all, in percent
+static void compareImages(const cv::Mat& expected, const cv::Mat& actual, int& max_error, double& pixels_off) {
+	max_error = 0;
+	long long count = 0;
+	for (int y = 0; y < expected.rows; y++) {
+		const cv::Vec3b* a = expected.ptr<cv::Vec3b>(y);
+		const cv::Vec3b* b = actual.ptr<cv::Vec3b>(y);
+		for (int x = 0; x < expected.cols; x++) {
+			int error = 0;
+			for (int c = 0; c < 3; c++)
+				error = max(error, abs((int)a[x][c] - (int)b[x][c]));
+			max_error = max(max_error, error);
+			count += error > 0;
+		}
+	}
+	pixels_off = 100.0 * count / max(1, expected.rows * expected.cols);
+}
+
+void benchmarkPBRMath(Rasterizer& rasterizer, const vector<pair<string, function<void(Rasterizer&)>>>& scenes,
+	const function<void(Shader::PBRMath)>& set_math, int repeats) {
+	cout << "scene       exact (ms)    fast (ms)    max error    pixels off" << endl;
+	for (const auto& [name, draw_frame] : scenes) {
+		cv::Mat exact, fast;
+		set_math(Shader::PBRMath::Exact);
+		double exact_ms = timeFrames(rasterizer, draw_frame, repeats, exact);
+		exact = exact.clone();
+		set_math(Shader::PBRMath::Fast);
+		double fast_ms = timeFrames(rasterizer, draw_frame, repeats, fast);
+
+		int max_error;
+		double pixels_off;
+		compareImages(exact, fast, max_error, pixels_off);
+		cout << left << setw(8) << name << right << setw(14) << fixed << setprecision(2) << exact_ms
+			<< setw(13) << fast_ms << setw(13) << max_error
+			<< setw(13) << setprecision(3) << pixels_off << "%" << endl;
+	}
+	set_math(Shader::PBRMath::Exact);
+}
+
+void benchmarkMeshDraw(Rasterizer& rasterizer, const Mesh& mesh, const Mat4& model, int repeats) {
+	vector<Triangle> triangles;
+	for (int t = 0; t < mesh.triangleCount(); t++)
+		triangles.push_back(mesh.triangle(t));
+	unordered_set<uint32_t> referenced(mesh.indices.begin(), mesh.indices.end());
+
+	cv::Mat triangle_pixels, mesh_pixels;
+	double triangle_ms = timeFrames(rasterizer, [&](Rasterizer& r) {
+		r.setModel(model);
+		r.drawTriangles(triangles);
+	}, repeats, triangle_pixels);
+	triangle_pixels = triangle_pixels.clone();
+	double mesh_ms = timeFrames(rasterizer, [&](Rasterizer& r) {
+		r.setModel(model);
+		r.drawMesh(mesh);
+	}, repeats, mesh_pixels);
+
+	cout << mesh.triangleCount() << " triangles, " << mesh.vertexCount() << " vertices" << endl;
+	cout << "form         memory (KB)    transforms    frame (ms)    identical" << endl;
+	cout << left << setw(9) << "triangles" << right << setw(15) << fixed << setprecision(1) << triangles.size() * sizeof(Triangle) / 1024.0
+		<< setw(14) << triangles.size() * 3 << setw(14) << setprecision(2) << triangle_ms << setw(13) << "-" << endl;
+	cout << left << setw(9) << "mesh" << right << setw(15) << setprecision(1) << mesh.memoryBytes() / 1024.0
+		<< setw(14) << referenced.size() << setw(14) << setprecision(2) << mesh_ms
+		<< setw(13) << (samePixels(triangle_pixels, mesh_pixels) ? "yes" : "NO") << endl;
+}
+
+void benchmarkBatchShading(Rasterizer& rasterizer, const vector<pair<string, function<void(Rasterizer&)>>>& scenes, int repeats) {
+	bool batch_shading = rasterizer.getBatchShading();
+	cout << "scene      scalar (ms)  batched (ms)   speedup    max error    pixels off" << endl;
+	for (const auto& [name, draw_frame] : scenes) {
+		cv::Mat scalar, batched;
+		rasterizer.setBatchShading(false);
+		double scalar_ms = timeFrames(rasterizer, draw_frame, repeats, scalar);
+		scalar = scalar.clone();
+		rasterizer.setBatchShading(true);
+		double batched_ms = timeFrames(rasterizer, draw_frame, repeats, batched);
+
+		int max_error;
+		double pixels_off;
+		compareImages(scalar, batched, max_error, pixels_off);
+		cout << left << setw(8) << name << right << setw(14) << fixed << setprecision(2) << scalar_ms
+			<< setw(14) << batched_ms << setw(9) << scalar_ms / batched_ms << "x" << setw(13) << max_error
+			<< setw(13) << setprecision(3) << pixels_off << "%" << endl;
+	}
+	rasterizer.setBatchShading(batch_shading);
+}
+
+void benchmarkLightCulling(Rasterizer& rasterizer, const function<void(Rasterizer&)>& draw_frame,
+	const vector<int>& light_counts, int repeats) {
+	vector<Shader::Light> scene_lights = rasterizer.getLights();
+	bool culling = rasterizer.getLightCulling();
+	int limit = rasterizer.getLightLimit();
+	const int tile_limit = 8;
+
+	cout << "lights    all (ms)    culled (ms)   speedup    identical    limit " << tile_limit << " (ms)    max error" << endl;
+	for (int count : light_counts) {
+		// small point lights scattered around the demo objects, on top of the scene's own lights
+		vector<Shader::Light> lights = scene_lights;
+		mt19937 rng(count);
+		uniform_real_distribution<float> unit(0.0f, 1.0f);
+		for (int i = 0; i < count; i++) {
+			Vec3 pos(-5.0f + 10.0f * unit(rng), 2.0f + 7.0f * unit(rng), -4.0f + 8.0f * unit(rng));
+			lights.push_back(Shader::Light(pos, Vec3(1.0f, 1.0f, 1.0f) * (2.0f + 4.0f * unit(rng)), 2.5f));
+		}
+		rasterizer.setLights(lights);
+
+		cv::Mat all, culled;
+		rasterizer.setLightCulling(false);
+		double all_ms = timeFrames(rasterizer, draw_frame, repeats, all);
+		all = all.clone();
+		rasterizer.setLightCulling(true);
+		double culled_ms = timeFrames(rasterizer, draw_frame, repeats, culled);
+		culled = culled.clone();
+
+		// the tile light limit drops the weakest lights of crowded tiles
+		cv::Mat limited;
+		rasterizer.setLightLimit(tile_limit);
+		double limited_ms = timeFrames(rasterizer, draw_frame, repeats, limited);
+		rasterizer.setLightLimit(limit);
+		int max_error;
+		double pixels_off;
+		compareImages(culled, limited, max_error, pixels_off);
+
+		cout << setw(6) << lights.size() << setw(12) << fixed << setprecision(2) << all_ms << setw(15) << culled_ms
+			<< setw(9) << all_ms / culled_ms << "x" << setw(13) << (samePixels(all, culled) ? "yes" : "NO")
+			<< setw(17) << limited_ms << setw(13) << max_error << endl;
+	}
+
+	rasterizer.setLights(scene_lights);
+	rasterizer.setLightCulling(culling);
+}
+
+void benchmarkShaderVariants(Shader& shader, PBRMaterial* material, const Skybox* skybox, int fragments) {
+	// fragments in front of the camera with random normals, lit like the demo scene; the texture
+	// coordinates walk the texture row by row like a rasterized surface, so texel fetches stay cached
+	vector<Shader::FragmentPayload> payloads;
+	mt19937 rng(12345);
+	uniform_real_distribution<float> signed_unit(-1.0f, 1.0f);
+	for (int i = 0; i < fragments; i++) {
+		Vec3 normal(signed_unit(rng), signed_unit(rng), signed_unit(rng));
+		Vec2 text_coord((i % 1024 + 0.5f) / 1024.0f, 1.0f - (i / 1024 % 1024 + 0.5f) / 1024.0f);
+		Shader::FragmentPayload f_p(Vec3(signed_unit(rng) * 2.0f, 5.0f + signed_unit(rng), signed_unit(rng)), Vec3(1, 1, 1),
+			text_coord, normal.normalized(), nullptr, material);
+		f_p.text_coord_dx = Vec2(1.0f / 1024.0f, 0.0f);
+		f_p.text_coord_dy = Vec2(0.0f, 1.0f / 1024.0f);
+		payloads.push_back(f_p);
+	}
+	vector<Shader::Light> lights = {
+		Shader::Light{ {-20, 20, -20}, {500, 500, 500} },
+		Shader::Light{ {-20, 20, 0}, {500, 500, 500} }
+	};
+
+	function<Vec3(const Shader::FragmentPayload&, const vector<Shader::Light>&)> fragment_shader =
+		[&shader, skybox](const Shader::FragmentPayload& f_p, const vector<Shader::Light>& l) {
+			return shader.pbrShader(f_p, l, skybox);
+		};
+	Shader::LightList light_list(lights);
+	Shader::PBRKernel kernel = shader.pbrKernel(material, skybox);
+	Shader::PBRBatchKernel batch_kernel = shader.pbrBatchKernel(material, skybox);
+	vector<Shader::FragmentBatch> batches((fragments + Shader::BATCH_SIZE - 1) / Shader::BATCH_SIZE);
+	for (int i = 0; i < fragments; i++) {
+		Shader::FragmentBatch& batch = batches[i / Shader::BATCH_SIZE];
+		batch.count = i % Shader::BATCH_SIZE + 1;
+		batch.pbr_material = material;
+		batch.set(i % Shader::BATCH_SIZE, payloads[i]);
+	}
+
+	// the checksums keep the calls from being optimized away
+	Vec3 sum_generic(0, 0, 0), sum_kernel(0, 0, 0);
+	vector<Vec3> kernel_colors(fragments), batch_colors(batches.size() * Shader::BATCH_SIZE);
+	auto start = chrono::steady_clock::now();
+	for (const Shader::FragmentPayload& f_p : payloads)
+		sum_generic += fragment_shader(f_p, lights);
+	double generic_s = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	start = chrono::steady_clock::now();
+	for (int i = 0; i < fragments; i++) {
+		kernel_colors[i] = kernel(shader, payloads[i], lights, skybox);
+		sum_kernel += kernel_colors[i];
+	}
+	double kernel_s = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	start = chrono::steady_clock::now();
+	for (size_t i = 0; i < batches.size(); i++)
+		batch_kernel(shader, batches[i], light_list, skybox, &batch_colors[i * Shader::BATCH_SIZE]);
+	double batch_s = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	// the batch kernel may round differently from the scalar one where the compiler fuses operations
+	float batch_error = 0.0f;
+	for (int i = 0; i < fragments; i++)
+		batch_error = max(batch_error, (batch_colors[i] - kernel_colors[i]).cwiseAbs().maxCoeff());
+
+	cout << fragments << " fragments, " << lights.size() << " lights" << endl;
+	cout << fixed << setprecision(1);
+	cout << "std::function + pbrShader: " << setw(8) << generic_s / fragments * 1e9 << " ns/fragment" << endl;
+	cout << "specialized kernel:        " << setw(8) << kernel_s / fragments * 1e9 << " ns/fragment ("
+		<< setprecision(2) << generic_s / kernel_s << "x, " << (sum_generic == sum_kernel ? "identical" : "DIFFERENT") << ")" << endl;
+	cout << "batch kernel, " << Shader::BATCH_SIZE << " lanes:   " << setw(8) << setprecision(1) << batch_s / fragments * 1e9
+		<< " ns/fragment (" << setprecision(2) << kernel_s / batch_s << "x over the kernel, max difference "
+		<< scientific << batch_error << ")" << defaultfloat << endl;
+}
+
+// hardware cache miss counter of the calling thread, -1 if the platform or the permissions do not allow one
+static int openCacheMissCounter() {
+#ifdef __linux__
+	perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.size = sizeof(attr);
+	attr.config = PERF_COUNT_HW_CACHE_MISSES;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+	return -1;
+#endif
+}
+
+void benchmarkTextureLayouts(Rasterizer& rasterizer, const function<void(Rasterizer&)>& draw_frame,
+	const function<void(TextureLayout)>& set_layout, int repeats) {
+	const pair<TextureLayout, const char*> layouts[] = {
+		{ TextureLayout::Linear, "linear" },
+		{ TextureLayout::Tiled, "tiled" }
+	};
+
+	int old_thread_count = rasterizer.getThreadCount();
+	rasterizer.setThreadCount(1); // the counter only sees the calling thread
+	int counter = openCacheMissCounter();
+	cv::Mat reference;
+
+	cout << "layout    frame (ms)    cache misses / frame    identical" << endl;
+	for (const auto& [layout, name] : layouts) {
+		set_layout(layout);
+		cv::Mat pixels;
+		long long misses = -1;
+#ifdef __linux__
+		if (counter >= 0) {
+			ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+			ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+		}
+#endif
+		double ms = timeFrames(rasterizer, draw_frame, repeats, pixels);
+#ifdef __linux__
+		if (counter >= 0) {
+			ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+			if (read(counter, &misses, sizeof(misses)) != sizeof(misses))
+				misses = -1;
+		}
+#endif
+		if (reference.empty())
+			reference = pixels.clone();
+		cout << left << setw(8) << name << right << setw(12) << fixed << setprecision(2) << ms << setw(24);
+		if (misses >= 0)
+			cout << misses / repeats;
+		else
+			cout << "n/a";
+		cout << setw(13) << (samePixels(reference, pixels) ? "yes" : "NO") << endl;
+	}
+
+#ifdef __linux__
+	if (counter >= 0)
+		close(counter);
+#endif
+	set_layout(TextureLayout::Linear);
+	rasterizer.setThreadCount(old_thread_count);
+}
+
+void benchmarkEdgeFunctions(int width, int height, int triangle_count) {
+	// random triangles of mixed sizes, fully on screen
+	mt19937 rng(12345);
+	uniform_real_distribution<float> pos_x(0.0f, (float)width - 1), pos_y(0.0f, (float)height - 1);
+	uniform_real_distribution<float> offset(-60.0f, 60.0f);
+	vector<Vec2> vertices;
+	for (int i = 0; i < triangle_count; i++) {
+		Vec2 center(pos_x(rng), pos_y(rng));
+		for (int j = 0; j < 3; j++) {
+			Vec2 v = center + Vec2(offset(rng), offset(rng));
+			vertices.push_back(Vec2(clamp(v.x(), 0.0f, (float)width - 1), clamp(v.y(), 0.0f, (float)height - 1)));
+		}
+	}
+
+	long long tested = 0, covered_barycentric = 0, covered_edge = 0;
+
+	auto start = chrono::steady_clock::now();
+	for (int i = 0; i < triangle_count; i++) {
+		const Vec2* v = &vertices[i * 3];
+		int minx = (int)floor(min({ v[0].x(), v[1].x(), v[2].x() }));
+		int maxx = (int)ceil(max({ v[0].x(), v[1].x(), v[2].x() }));
+		int miny = (int)floor(min({ v[0].y(), v[1].y(), v[2].y() }));
+		int maxy = (int)ceil(max({ v[0].y(), v[1].y(), v[2].y() }));
+		for (int y = miny; y <= maxy; y++)
+			for (int x = minx; x <= maxx; x++) {
+				float alpha, beta, gamma;
+				barycentric(x + 0.5f, y + 0.5f, v[0], v[1], v[2], alpha, beta, gamma);
+				if (alpha >= 0 && beta >= 0 && gamma >= 0)
+					covered_barycentric++;
+			}
+		tested += (long long)(maxx - minx + 1) * (maxy - miny + 1);
+	}
+	auto mid = chrono::steady_clock::now();
+	for (int i = 0; i < triangle_count; i++) {
+		const Vec2* v = &vertices[i * 3];
+		int minx = (int)floor(min({ v[0].x(), v[1].x(), v[2].x() }));
+		int maxx = (int)ceil(max({ v[0].x(), v[1].x(), v[2].x() }));
+		int miny = (int)floor(min({ v[0].y(), v[1].y(), v[2].y() }));
+		int maxy = (int)ceil(max({ v[0].y(), v[1].y(), v[2].y() }));
+		EdgeFunctions e;
+		if (!edgeFunctions(v[0], v[1], v[2], e))
+			continue;
+		int64_t w_row[3];
+		for (int k = 0; k < 3; k++)
+			w_row[k] = e.a[k] * ((int64_t)minx * SUBPIXEL_ONE + SUBPIXEL_ONE / 2)
+				+ e.b[k] * ((int64_t)miny * SUBPIXEL_ONE + SUBPIXEL_ONE / 2) + e.c[k];
+		for (int y = miny; y <= maxy; y++) {
+			int64_t w0 = w_row[0], w1 = w_row[1], w2 = w_row[2];
+			for (int x = minx; x <= maxx; x++) {
+				if ((w0 | w1 | w2) >= 0)
+					covered_edge++;
+				w0 += e.a[0] * SUBPIXEL_ONE;
+				w1 += e.a[1] * SUBPIXEL_ONE;
+				w2 += e.a[2] * SUBPIXEL_ONE;
+			}
+			for (int k = 0; k < 3; k++)
+				w_row[k] += e.b[k] * SUBPIXEL_ONE;
+		}
+	}
+	auto end = chrono::steady_clock::now();
+
+	double barycentric_s = chrono::duration<double>(mid - start).count();
+	double edge_s = chrono::duration<double>(end - mid).count();
+	cout << triangle_count << " triangles, " << tested << " pixels tested" << endl;
+	cout << fixed << setprecision(1);
+	cout << "barycentric():  " << setw(8) << tested / barycentric_s * 1e-6 << " Mpixels/s, " << covered_barycentric << " covered" << endl;
+	cout << "edge functions: " << setw(8) << tested / edge_s * 1e-6 << " Mpixels/s, " << covered_edge << " covered" << endl;
+}
+
+void benchmarkTextureSampling(int width, int height) {
+	const int size = 1024;
+	cv::Mat image(size, size, CV_8UC3);
+	mt19937 rng(12345);
+	for (int y = 0; y < size; y++)
+		for (int x = 0; x < size; x++)
+			for (int c = 0; c < 3; c++)
+				image.at<cv::Vec3b>(y, x)[c] = (uchar)(rng() & 255);
+	Texture texture(image);
+
+	// texture coordinates of every pixel: scale texels per pixel, from 1 in the top row to 16 in the bottom row
+	vector<Vec2> uv(width * height);
+	vector<float> scale(height);
+	float v = 0.0f;
+	for (int y = 0; y < height; y++) {
+		scale[y] = 1.0f + 15.0f * y / max(1, height - 1);
+		for (int x = 0; x < width; x++)
+			uv[y * width + x] = Vec2(fmod((x + 0.5f) * scale[y] / size, 1.0f), 1.0f - fmod(v, 1.0f));
+		v += scale[y] / size;
+	}
+
+	// cache lines the lookups touch, replaying the texel addresses of getColor and sample
+	unordered_set<uintptr_t> point_lines, mip_lines;
+	auto touch = [&texture](unordered_set<uintptr_t>& lines, int level, int x, int y) {
+		cv::Size level_size = texture.levelSize(level);
+		lines.insert((uintptr_t)texture.texelAddress(level, clamp(x, 0, level_size.width - 1), clamp(y, 0, level_size.height - 1)) / 64);
+	};
+	for (int y = 0; y < height; y++) {
+		float lod = texture.lod(Vec2(scale[y] / size, 0.0f), Vec2(0.0f, scale[y] / size));
+		for (int x = 0; x < width; x++) {
+			const Vec2& t = uv[y * width + x];
+			touch(point_lines, 0, (int)(t.x() * (size - 1)), (int)((1.0f - t.y()) * (size - 1)));
+			int first = clamp((int)max(lod, 0.0f), 0, texture.levels() - 1);
+			for (int l = first; l <= min(first + 1, texture.levels() - 1); l++) {
+				cv::Size level_size = texture.levelSize(l);
+				int tx = (int)floor(t.x() * level_size.width - 0.5f), ty = (int)floor((1.0f - t.y()) * level_size.height - 0.5f);
+				for (int k = 0; k < 4; k++)
+					touch(mip_lines, l, tx + (k & 1), ty + (k >> 1));
+			}
+		}
+	}
+
+	// seconds for one trilinear lookup per pixel, the checksum keeps the lookups from being optimized away
+	auto time_trilinear = [&](const Texture& t, Vec3& checksum) {
+		auto start = chrono::steady_clock::now();
+		for (int y = 0; y < height; y++) {
+			float lod = t.lod(Vec2(scale[y] / size, 0.0f), Vec2(0.0f, scale[y] / size));
+			for (int x = 0; x < width; x++)
+				checksum += t.sample(uv[y * width + x].x(), uv[y * width + x].y(), lod);
+		}
+		return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	};
+
+	Vec3 sum_point(0, 0, 0), sum_mip(0, 0, 0);
+	auto start = chrono::steady_clock::now();
+	for (int i = 0; i < width * height; i++)
+		sum_point += texture.getColor(uv[i].x(), uv[i].y());
+	double point_s = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	double mip_s = time_trilinear(texture, sum_mip);
+
+	double samples = (double)width * height;
+	cout << width * height << " samples, " << size << "x" << size << " texture, " << texture.levels() << " mip levels" << endl;
+	cout << fixed << setprecision(1);
+	cout << "point, level 0:   " << setw(8) << samples / point_s * 1e-6 << " Msamples/s, "
+		<< setw(8) << point_lines.size() * 64 / 1024.0 << " KB touched (checksum " << sum_point.sum() << ")" << endl;
+	cout << "trilinear mipmap: " << setw(8) << samples / mip_s * 1e-6 << " Msamples/s, "
+		<< setw(8) << mip_lines.size() * 64 / 1024.0 << " KB touched (checksum " << sum_mip.sum() << ")" << endl;
+
+	// storage formats: memory of the whole mip chain and trilinear throughput
+	const pair<TextureFormat, const char*> formats[] = {
+		{ TextureFormat::RGBA8, "RGBA8" },
+		{ TextureFormat::RGBA32F, "RGBA32F" },
+		{ TextureFormat::R8, "R8" }
+	};
+	cout << "format    memory (KB)    trilinear Msamples/s" << endl;
+	for (const auto& [format, name] : formats) {
+		Texture t(image, format);
+		Vec3 checksum(0, 0, 0);
+		double s = time_trilinear(t, checksum);
+		cout << left << setw(8) << name << right << setw(13) << t.memoryBytes() / 1024.0 << setw(24) << samples / s * 1e-6 << endl;
+	}
+}
+
+void benchmarkSkyboxSampling(const string& panorama_file, int lookups) {
+	Texture panorama(panorama_file);
+	Skybox skybox;
+	auto start = chrono::steady_clock::now();
+	if (!skybox.loadFromFile(panorama_file)) {
+		cout << "cannot load " << panorama_file << endl;
+		return;
+	}
+	double convert_s = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	// random view directions and random texture coordinates for the plain fetch
+	vector<Vec3> dirs(lookups);
+	vector<Vec2> uv(lookups);
+	mt19937 rng(12345);
+	normal_distribution<float> gauss;
+	uniform_real_distribution<float> unit(0.0f, 1.0f);
+	for (int i = 0; i < lookups; i++) {
+		dirs[i] = Vec3(gauss(rng), gauss(rng), gauss(rng)).normalized();
+		uv[i] = Vec2(unit(rng), unit(rng));
+	}
+
+	// seconds for all lookups, the checksum keeps them from being optimized away
+	auto time_lookups = [lookups](const function<Vec3(int)>& lookup, Vec3& checksum) {
+		auto start = chrono::steady_clock::now();
+		for (int i = 0; i < lookups; i++)
+			checksum += lookup(i);
+		return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	};
+
+	Vec3 sum_plain(0, 0, 0), sum_equirect(0, 0, 0), sum_cube(0, 0, 0), sum_ambient(0, 0, 0);
+	double plain_s = time_lookups([&](int i) { return panorama.sample(uv[i].x(), uv[i].y(), 0.0f); }, sum_plain);
+	const float pi = 3.14159265358979f;
+	double equirect_s = time_lookups([&](int i) {
+		const Vec3& d = dirs[i];
+		float u = atan2(d.z(), d.x()) / (2.0f * pi) + 0.5f;
+		float v = asin(clamp(d.y(), -1.0f, 1.0f)) / pi + 0.5f;
+		return panorama.sample(u, v, 0.0f);
+	}, sum_equirect);
+	double cube_s = time_lookups([&](int i) { return skybox.getColor(dirs[i]); }, sum_cube);
+	double ambient_s = time_lookups([&](int i) { return skybox.getAmbientColor(dirs[i]); }, sum_ambient);
+
+	cout << lookups << " lookups, " << panorama.w() << "x" << panorama.h() << " panorama, cubemap built in "
+		<< fixed << setprecision(1) << convert_s * 1000.0 << " ms" << endl;
+	cout << "plain texture fetch:  " << setw(8) << lookups / plain_s * 1e-6 << " Mlookups/s (checksum " << sum_plain.sum() << ")" << endl;
+	cout << "equirect atan2/asin:  " << setw(8) << lookups / equirect_s * 1e-6 << " Mlookups/s (checksum " << sum_equirect.sum() << ")" << endl;
+	cout << "cubemap:              " << setw(8) << lookups / cube_s * 1e-6 << " Mlookups/s (checksum " << sum_cube.sum() << ")" << endl;
+	cout << "cubemap, ambient lod: " << setw(8) << lookups / ambient_s * 1e-6 << " Mlookups/s (checksum " << sum_ambient.sum() << ")" << endl;
+}
+
+static bool sameMesh(const Mesh& a, const Mesh& b) {
+	if (a.pos_x != b.pos_x || a.pos_y != b.pos_y || a.pos_z != b.pos_z ||
+		a.normal_x != b.normal_x || a.normal_y != b.normal_y || a.normal_z != b.normal_z ||
+		a.u != b.u || a.v != b.v || a.indices != b.indices || a.submeshes.size() != b.submeshes.size() ||
+		a.bounds_min != b.bounds_min || a.bounds_max != b.bounds_max)
+		return false;
+	for (size_t i = 0; i < a.submeshes.size(); i++) {
+		const Mesh::SubMesh& s = a.submeshes[i];
+		const Mesh::SubMesh& t = b.submeshes[i];
+		if (s.name != t.name || s.material != t.material || s.first_index != t.first_index || s.index_count != t.index_count ||
+			s.bounds_min != t.bounds_min || s.bounds_max != t.bounds_max)
+			return false;
+	}
+	return true;
+}
+
+void benchmarkOBJLoading(const vector<string>& files, int repeats) {
+	struct Result {
+		size_t bytes;
+		int triangles;
+		double objl_ms, reader_ms;
+		bool objl_loaded, identical;
+	};
+	vector<Result> results;
+	for (const string& file : files) { // objl prints progress while loading, the table follows all loads
+		Result result{ 0, 0, 0.0, 0.0, false, false };
+		error_code error;
+		result.bytes = (size_t)filesystem::file_size(file, error);
+
+		Mesh objl_mesh, reader_mesh;
+		bool loaded = true;
+		auto start = chrono::steady_clock::now();
+		for (int i = 0; i < repeats && loaded; i++) {
+			objl::Loader loader;
+			try {
+				loaded = loader.LoadFile(file);
+			} catch (const exception&) { // stof throws on the empty tokens objl splits out of repeated blanks
+				loaded = false;
+			}
+			objl_mesh = Mesh(loader);
+		}
+		result.objl_loaded = loaded;
+		result.objl_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() / repeats;
+		loaded = true;
+		start = chrono::steady_clock::now();
+		for (int i = 0; i < repeats && loaded; i++)
+			loaded = readOBJ(file, reader_mesh, 1);
+		result.reader_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() / repeats;
+		result.triangles = reader_mesh.triangleCount();
+		result.identical = loaded && result.objl_loaded && sameMesh(objl_mesh, reader_mesh);
+		results.push_back(result);
+	}
+
+	cout << endl << "file                      size (KB)   triangles   objl (ms)   readOBJ (ms)   speedup   identical" << endl;
+	for (size_t i = 0; i < files.size(); i++) {
+		const Result& r = results[i];
+		cout << left << setw(24) << filesystem::path(files[i]).filename().string() << right << fixed
+			<< setw(11) << setprecision(1) << r.bytes / 1024.0 << setw(12) << r.triangles
+			<< setw(12) << setprecision(2);
+		if (r.objl_loaded)
+			cout << r.objl_ms << setw(15) << r.reader_ms << setw(9) << setprecision(1) << r.objl_ms / max(r.reader_ms, 1e-6) << "x"
+				<< setw(12) << (r.identical ? "yes" : "NO") << endl;
+		else
+			cout << "-" << setw(15) << r.reader_ms << setw(10) << "-" << setw(12) << "objl fails" << endl;
+	}
+}
+
+void benchmarkOBJThreads(const string& file, int repeats) {
+	int max_threads = max(1, (int)thread::hardware_concurrency());
+	vector<int> thread_counts;
+	for (int n = 1; n < max_threads; n *= 2)
+		thread_counts.push_back(n);
+	thread_counts.push_back(max_threads);
+
+	Mesh reference;
+	double single_ms = 0.0;
+
+	cout << filesystem::path(file).filename().string() << endl;
+	cout << "threads    load (ms)    speedup    identical" << endl;
+	for (int n : thread_counts) {
+		Mesh mesh;
+		bool loaded = true;
+		auto start = chrono::steady_clock::now();
+		for (int i = 0; i < repeats && loaded; i++)
+			loaded = readOBJ(file, mesh, n);
+		double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() / repeats;
+		if (!loaded) {
+			cout << "cannot load " << file << endl;
+			return;
+		}
+		if (n == 1) {
+			reference = mesh;
+			single_ms = ms;
+		}
+		cout << setw(7) << n << setw(13) << fixed << setprecision(2) << ms
+			<< setw(10) << setprecision(2) << single_ms / ms << "x"
+			<< setw(13) << (sameMesh(reference, mesh) ? "yes" : "NO") << endl;
+	}
+}
+
+void benchmarkMeshCache(const string& file, int repeats) {
+	Mesh parsed, cached;
+	bool loaded = true;
+	auto start = chrono::steady_clock::now();
+	for (int i = 0; i < repeats && loaded; i++)
+		loaded = readOBJ(file, parsed);
+	double parse_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() / repeats;
+	if (!loaded) {
+		cout << "cannot load " << file << endl;
+		return;
+	}
+
+	start = chrono::steady_clock::now();
+	parsed.optimize(); // as readOBJCached caches it
+	double optimize_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+	start = chrono::steady_clock::now();
+	bool saved = saveMeshCache(file, parsed);
+	double save_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+	start = chrono::steady_clock::now();
+	for (int i = 0; i < repeats && loaded; i++)
+		loaded = loadMeshCache(file, cached);
+	double load_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() / repeats;
+	if (!saved || !loaded) {
+		cout << "cannot write or read the cache of " << file << endl;
+		return;
+	}
+
+	error_code error;
+	cout << filesystem::path(file).filename().string() << ": " << parsed.triangleCount() << " triangles, cache "
+		<< fixed << setprecision(1) << filesystem::file_size(file + ".mesh", error) / 1024.0 << " KB" << endl;
+	cout << "parse OBJ:   " << setw(9) << setprecision(2) << parse_ms << " ms" << endl;
+	cout << "optimize:    " << setw(9) << optimize_ms << " ms" << endl;
+	cout << "write cache: " << setw(9) << save_ms << " ms" << endl;
+	cout << "read cache:  " << setw(9) << load_ms << " ms (" << setprecision(0) << parse_ms / max(load_ms, 1e-6)
+		<< "x faster, identical: " << (sameMesh(parsed, cached) ? "yes" : "NO") << ")" << endl;
+}
+
+void benchmarkPolygonTriangulation(int corners, int repeats) {
+	const int max_objl_corners = 64; // objl's ear clipping is cubic in the corner count
+	cout << endl << "shape    corners   polygons   objl (ms)   readOBJ (ms)   speedup   area error   flipped" << endl;
+	for (bool star : { false, true })
+		for (int n : { 8, 64, 512, 4096 }) {
+			// a regular polygon or a star of alternating radii, tilted out of the coordinate planes
+			Mat3 tilt = Eigen::AngleAxisf(0.7f, Vec3(1, 2, 3).normalized()).toRotationMatrix();
+			int polygon_count = max(1, corners / n);
+			string file = (filesystem::temp_directory_path() / ("triangulation_" + to_string(star) + "_" + to_string(n) + ".obj")).string();
+			{
+				ofstream out(file);
+				out << setprecision(9);
+				for (int k = 0; k < n; k++) {
+					float angle = 6.2831853f * k / n, radius = star && k % 2 ? 0.5f : 1.0f;
+					Vec3 p = tilt * Vec3(radius * cos(angle), radius * sin(angle), 0);
+					out << "v " << p.x() << " " << p.y() << " " << p.z() << "\n";
+				}
+				for (int f = 0; f < polygon_count; f++) {
+					out << "f";
+					for (int k = 0; k < n; k++)
+						out << " " << k + 1;
+					out << "\n";
+				}
+			}
+
+			double objl_ms = -1.0;
+			if (n <= max_objl_corners) {
+				auto start = chrono::steady_clock::now();
+				for (int i = 0; i < repeats; i++) {
+					objl::Loader loader;
+					loader.LoadFile(file);
+				}
+				objl_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() / repeats;
+			}
+			Mesh mesh;
+			bool loaded = true;
+			auto start = chrono::steady_clock::now();
+			for (int i = 0; i < repeats && loaded; i++)
+				loaded = readOBJ(file, mesh, 1);
+			double reader_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() / repeats;
+			filesystem::remove(file);
+			if (!loaded || mesh.triangleCount() != polygon_count * (n - 2)) {
+				cout << "cannot triangulate " << file << endl;
+				continue;
+			}
+
+			// the triangles of every polygon cover its area once and keep its winding
+			Vec3 area_vector(0, 0, 0);
+			for (int k = 0; k < n; k++)
+				area_vector += mesh.position(k).cross(mesh.position((k + 1) % n)) / 2;
+			float area = area_vector.norm();
+			Vec3 normal = area_vector / area;
+			double covered = 0.0;
+			int flipped = 0;
+			for (int t = 0; t < mesh.triangleCount(); t++) {
+				Vec3 a = mesh.position(mesh.indices[3 * t]), b = mesh.position(mesh.indices[3 * t + 1]), c = mesh.position(mesh.indices[3 * t + 2]);
+				float signed_area = (b - a).cross(c - a).dot(normal) / 2;
+				covered += abs(signed_area);
+				flipped += signed_area < -1e-4f * area;
+			}
+			double area_error = abs(covered / polygon_count - area) / area;
+
+			cout << left << setw(9) << (star ? "star" : "convex") << right << setw(7) << n << setw(11) << polygon_count << fixed << setprecision(2);
+			if (objl_ms >= 0)
+				cout << setw(12) << objl_ms << setw(15) << reader_ms << setw(9) << setprecision(1) << objl_ms / max(reader_ms, 1e-6) << "x";
+			else
+				cout << setw(12) << "-" << setw(15) << reader_ms << setw(10) << "-";
+			cout << setw(13) << scientific << setprecision(1) << area_error << defaultfloat << setw(10) << flipped << endl;
+		}
+}
+
+// the triangles' attributes, each rotated to start at its smallest corner so the winding is kept, sorted
+static vector<array<float, 24>> triangleSet(const Mesh& mesh) {
+	vector<array<float, 24>> triangles(mesh.triangleCount());
+	for (int t = 0; t < mesh.triangleCount(); t++) {
+		array<array<float, 8>, 3> corners;
+		for (int j = 0; j < 3; j++) {
+			uint32_t i = mesh.indices[t * 3 + j];
+			corners[j] = { mesh.pos_x[i], mesh.pos_y[i], mesh.pos_z[i], mesh.normal_x[i], mesh.normal_y[i], mesh.normal_z[i], mesh.u[i], mesh.v[i] };
+		}
+		int first = (int)(min_element(corners.begin(), corners.end()) - corners.begin());
+		for (int j = 0; j < 3; j++)
+			copy(corners[(first + j) % 3].begin(), corners[(first + j) % 3].end(), triangles[t].begin() + j * 8);
+	}
+	sort(triangles.begin(), triangles.end());
+	return triangles;
+}
+
+void benchmarkMeshOptimization(const vector<string>& files) {
+	for (const string& file : files) {
+		Mesh mesh;
+		if (!readOBJ(file, mesh)) {
+			cout << "cannot load " << file << endl;
+			continue;
+		}
+		vector<array<float, 24>> loaded_triangles = triangleSet(mesh);
+
+		cout << endl << filesystem::path(file).filename().string() << ": " << mesh.triangleCount() << " triangles" << endl;
+		cout << "stage             vertices   memory (KB)   ACMR (16)   ACMR (32)   time (ms)" << endl;
+		auto print = [&mesh](const string& stage, double ms) {
+			cout << left << setw(16) << stage << right << setw(10) << mesh.vertexCount() << fixed << setprecision(1)
+				<< setw(14) << mesh.memoryBytes() / 1024.0 << setprecision(3) << setw(12) << mesh.cacheMissRatio(16)
+				<< setw(12) << mesh.cacheMissRatio(32) << setprecision(2);
+			if (ms >= 0)
+				cout << setw(12) << ms << endl;
+			else
+				cout << setw(12) << "-" << endl;
+		};
+		auto stage = [&](const string& name, const function<void()>& run) {
+			auto start = chrono::steady_clock::now();
+			run();
+			print(name, chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+		};
+		print("loaded", -1.0);
+		stage("welded", [&] { mesh.weldVertices(); });
+		stage("triangle order", [&] { mesh.optimizeTriangleOrder(); });
+		stage("vertex order", [&] { mesh.optimizeVertexOrder(); });
+		cout << "same triangles: " << (triangleSet(mesh) == loaded_triangles ? "yes" : "NO") << endl;
+	}
+}
@@ -0,0 +1,88 @@
+#ifndef RASTERIZER_BENCHMARK_H
+#define RASTERIZER_BENCHMARK_H
+
+#include "rasterizer.hpp"
+#include "skybox.hpp"
+#include <functional>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Render the frame drawn by draw_frame with 1, 2, 4, ... threads up to the core count,
+// print the average frame time per thread count and check the output against the 1-thread frame
+void benchmarkThreadScaling(Rasterizer& rasterizer, const function<void(Rasterizer&)>& draw_frame, int repeats = 5);
+
+// Render every scene with every coverage kernel the CPU supports, print the average frame time
+// per kernel and check the output against the scalar kernel
+void benchmarkRasterKernels(Rasterizer& rasterizer, const vector<pair<string, function<void(Rasterizer&)>>>& scenes, int repeats = 5);
+
+// Render the frame in forward, deferred and z-prepass shading mode, print the average frame time, the
+// fragment shader invocations and the overdraw (shaded fragments per covered pixel) per mode
+void benchmarkShadingModes(Rasterizer& rasterizer, const function<void(Rasterizer&)>& draw_frame, int repeats = 5);
+
+// Render every scene with the exact and the fast PBR math (set_math switches the shader), print the
+// average frame time per path and the largest per-channel error of the fast image in 8-bit steps
+void benchmarkPBRMath(Rasterizer& rasterizer, const vector<pair<string, function<void(Rasterizer&)>>>& scenes,
+	const function<void(Shader::PBRMath)>& set_math, int repeats = 5);
+
+// Draw the mesh with the given model matrix as a Triangle list and as an indexed mesh, print the memory of
+// both forms, the vertex transforms per draw and the average frame time, and check that the images agree
+void benchmarkMeshDraw(Rasterizer& rasterizer, const Mesh& mesh, const Mat4& model, int repeats = 5);
+
+// Render every scene shading one fragment at a time and in batches (Rasterizer::setBatchShading), print
+// the average frame time per path and the largest per-channel difference of the batched image in 8-bit steps
+void benchmarkBatchShading(Rasterizer& rasterizer, const vector<pair<string, function<void(Rasterizer&)>>>& scenes, int repeats = 5);
+
+// Add each count of small point lights with a finite radius to the rasterizer's lights, render the frame
+// with every light in every tile, with the lights culled per tile and with a light limit per tile,
+// print the frame times, check that culling leaves the image unchanged and report the error of the limit
+void benchmarkLightCulling(Rasterizer& rasterizer, const function<void(Rasterizer&)>& draw_frame,
+	const vector<int>& light_counts = { 8, 32, 64 }, int repeats = 3);
+
+// Shade random fragments of the material through a std::function forwarding to Shader::pbrShader, which
+// resolves the material features per fragment, through the kernel specialized for them, picked once, and
+// through the batch kernel; print the time per fragment of each and check that they agree
+void benchmarkShaderVariants(Shader& shader, PBRMaterial* material, const Skybox* skybox, int fragments = 1 << 20);
+
+// Render the frame with the material textures in every memory layout (set_layout reloads them),
+// print the average frame time and the hardware cache misses per frame where the platform has counters
+void benchmarkTextureLayouts(Rasterizer& rasterizer, const function<void(Rasterizer&)>& draw_frame,
+	const function<void(TextureLayout)>& set_layout, int repeats = 5);
+
+// Coverage-only micro-benchmark on random triangles: per-pixel barycentric() against
+// incremental fixed-point edge functions, reported in tested pixels per second
+void benchmarkEdgeFunctions(int width, int height, int triangle_count = 20000);
+
+// Texture lookups on a surface minified from 1x to 16x across the screen: point sampling of the
+// full resolution image against trilinear mipmap sampling, reported in samples per second and
+// in distinct 64-byte cache lines the lookups touch
+void benchmarkTextureSampling(int width, int height);
+
+// Sky lookups in random directions: the per-lookup atan2 / asin of the equirectangular panorama
+// against the cubemap the Skybox builds from it, next to a plain fetch from the panorama
+void benchmarkSkyboxSampling(const string& panorama_file, int lookups = 1 << 21);
+
+// Load every OBJ file into a Mesh with objl::Loader and with readOBJ on one thread, print the average
+// load time of both and check that the meshes are identical
+void benchmarkOBJLoading(const vector<string>& files, int repeats = 3);
+
+// Load the OBJ file with readOBJ on 1, 2, 4, ... threads up to the core count, print the average
+// load time per thread count and check the mesh against the 1-thread load
+void benchmarkOBJThreads(const string& file, int repeats = 5);
+
+// Parse the OBJ file, optimize the mesh, write its binary mesh cache and read it back, print the
+// time of each and check that the cached mesh is identical
+void benchmarkMeshCache(const string& file, int repeats = 5);
+
+// Run the Mesh::optimize stages on each OBJ file one by one, print vertex count, memory, the
+// ACMR of FIFO caches of 16 and 32 vertices and the time after each, and check that the mesh
+// still draws the same triangles
+void benchmarkMeshOptimization(const vector<string>& files);
+
+// Load OBJ files of convex and star shaped polygons of 8 to 4096 corners, corners corners per file, with
+// objl::Loader (up to 64 corners) and readOBJ, print the load times and check that each polygon's
+// triangles cover its area once without flipped triangles
+void benchmarkPolygonTriangulation(int corners = 1 << 16, int repeats = 3);
+
+#endif
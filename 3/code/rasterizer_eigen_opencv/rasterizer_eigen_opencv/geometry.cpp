@@ -1,5 +1,6 @@
 #include "geometry.hpp"
 #include <Eigen/Eigen>
+#include <cmath>
 
 const double PI = 3.14159265358979323846;
 double Deg2Rad(double deg) {
@@ -120,3 +121,46 @@ void barycentric(float x, float y, const Vec2& a, const Vec2& b, const Vec2& c,
     beta = ((c.y() - a.y()) * (x - c.x()) + (a.x() - c.x()) * (y - c.y())) / demon;
     gamma = 1.0 - alpha - beta;
 }
+
+bool edgeFunctions(const Vec2& a, const Vec2& b, const Vec2& c, EdgeFunctions& e) {
+    // keep coordinates below 2^30 subpixels so that products of two of them fit in 64 bits
+    const float limit = (float)(1 << (30 - SUBPIXEL_BITS));
+    const Vec2* v[3] = { &a, &b, &c };
+    int64_t vx[3], vy[3];
+    for (int i = 0; i < 3; i++) {
+        if (!(fabs(v[i]->x()) < limit && fabs(v[i]->y()) < limit))
+            return false;
+        vx[i] = llround(v[i]->x() * SUBPIXEL_ONE);
+        vy[i] = llround(v[i]->y() * SUBPIXEL_ONE);
+    }
+
+    // edge opposite to vertex i runs from j to k
+    for (int i = 0; i < 3; i++) {
+        int j = (i + 1) % 3, k = (i + 2) % 3;
+        e.a[i] = vy[j] - vy[k];
+        e.b[i] = vx[k] - vx[j];
+        e.c[i] = vx[j] * vy[k] - vy[j] * vx[k];
+    }
+
+    int64_t area = e.a[0] * vx[0] + e.b[0] * vy[0] + e.c[0];
+    if (area == 0)
+        return false;
+    if (area < 0) { // flip so that the inside is positive for both windings
+        for (int i = 0; i < 3; i++) {
+            e.a[i] = -e.a[i];
+            e.b[i] = -e.b[i];
+            e.c[i] = -e.c[i];
+        }
+        area = -area;
+    }
+    e.inv_area = 1.0f / (float)area;
+
+    // top-left rule: samples exactly on an edge (w == 0) only count for left edges (inside towards +x)
+    // and top edges (horizontal, inside towards +y since y points down), so shared edges are drawn once
+    for (int i = 0; i < 3; i++) {
+        bool top_left = e.a[i] > 0 || (e.a[i] == 0 && e.b[i] > 0);
+        if (!top_left)
+            e.c[i] -= 1;
+    }
+    return true;
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <Eigen/Eigen>
+#include <cstdint>
 
 using namespace std;
 using Vec2 = Eigen::Vector2f;
@@ -17,3 +18,16 @@ Mat4 perspective(float eye_fov, float aspect_ratio, float z_near, float z_far);
 Mat4 model(const Vec3& angles, const Vec3& axis); // model transformation
 
 void barycentric(float x, float y, const Vec2& a, const Vec2& b, const Vec2& c, float& alpha, float& beta, float& gamma); // calculate barycentric coordinates within triangle ABC
+
+const int SUBPIXEL_BITS = 4; // screen coordinates are snapped to 1/16 pixel for rasterization
+const int SUBPIXEL_ONE = 1 << SUBPIXEL_BITS;
+
+struct EdgeFunctions { // w[i](x, y) = a[i] * x + b[i] * y + c[i] with x, y in subpixel units, w[i] is the weight of vertex i
+	int64_t a[3], b[3], c[3];
+	float inv_area; // 1 / (w[0] + w[1] + w[2]), turns edge values into barycentric coordinates
+};
+
+// set up the fixed-point edge functions of triangle ABC (either winding), w >= 0 exactly on the covered samples;
+// samples on an edge are only covered by the triangle it is a top or left edge of (top-left fill rule)
+// returns false if the triangle is degenerate or too far off screen for 64-bit edge values
+bool edgeFunctions(const Vec2& a, const Vec2& b, const Vec2& c, EdgeFunctions& e);
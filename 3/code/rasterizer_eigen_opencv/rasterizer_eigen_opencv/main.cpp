@@ -1,113 +1,210 @@
 #include "rasterizer.hpp"
 #include "triangle.hpp"
+#include "mesh.hpp"
 #include "texture.hpp"
 #include "shader.hpp"
 #include "geometry.hpp"
 #include "material.hpp"
 #include "skybox.hpp"
-#include "OBJ_Loader.h"
+#include "benchmark.hpp"
+#include "mesh_cache.hpp"
 #include <vector>
 #include <opencv2/opencv.hpp>
 #include <Eigen/Eigen>
 #include <iostream>
 #include <stdexcept>
+#include <string>
 
 int main(int argc, char** argv) {
+	// command line: [--threads N] [--kernel scalar|sse2|avx2] [--deferred | --zprepass] [--tiled-textures] [--fast-pbr] [--batch-shading] [--bench] [--bench-raster] [--bench-texture] [--bench-skybox] [--bench-obj]
+	int thread_count = 1;
+	Rasterizer::ShadingMode shading_mode = Rasterizer::ShadingMode::Forward;
+	RasterKernel raster_kernel = bestRasterKernel();
+	TextureLayout texture_layout = TextureLayout::Linear;
+	Shader::PBRMath pbr_math = Shader::PBRMath::Exact;
+	bool batch_shading = false;
+	bool run_benchmark = false;
+	const string skybox_file = "../res/skyboxes/HdrOutdoorFieldBaseballDayClear001/HdrOutdoorFieldBaseballDayClear001_JPG_4K.JPG";
+	for (int i = 1; i < argc; i++) {
+		string arg = argv[i];
+		if (arg == "--threads" && i + 1 < argc)
+			thread_count = stoi(argv[++i]);
+		else if (arg == "--kernel" && i + 1 < argc) {
+			string name = argv[++i];
+			if (name == "scalar")
+				raster_kernel = RasterKernel::Scalar;
+			else if (name == "sse2")
+				raster_kernel = RasterKernel::SSE2;
+			else if (name == "avx2")
+				raster_kernel = RasterKernel::AVX2;
+			else {
+				std::cerr << "Unknown raster kernel: " << name << " (expected scalar, sse2 or avx2)" << std::endl;
+				return 1;
+			}
+		}
+		else if (arg == "--deferred")
+			shading_mode = Rasterizer::ShadingMode::Deferred;
+		else if (arg == "--zprepass")
+			shading_mode = Rasterizer::ShadingMode::ZPrepass;
+		else if (arg == "--tiled-textures")
+			texture_layout = TextureLayout::Tiled;
+		else if (arg == "--fast-pbr")
+			pbr_math = Shader::PBRMath::Fast;
+		else if (arg == "--batch-shading")
+			batch_shading = true;
+		else if (arg == "--bench")
+			run_benchmark = true;
+		else if (arg == "--bench-raster") {
+			benchmarkEdgeFunctions(1600, 900);
+			return 0;
+		}
+		else if (arg == "--bench-texture") {
+			benchmarkTextureSampling(1600, 900);
+			return 0;
+		}
+		else if (arg == "--bench-skybox") {
+			benchmarkSkyboxSampling(skybox_file);
+			return 0;
+		}
+		else if (arg == "--bench-obj") {
+			benchmarkOBJLoading({ "../res/objects/android.obj", "../res/objects/bot.obj", "../res/objects/cube.obj", "../res/objects/test.obj" });
+			benchmarkOBJThreads("../res/objects/android.obj");
+			benchmarkMeshCache("../res/objects/android.obj");
+			benchmarkPolygonTriangulation();
+			benchmarkMeshOptimization({ "../res/objects/android.obj", "../res/objects/test.obj" });
+			return 0;
+		}
+	}
+
 	// initialize rasterizer
 	int w = 1600, h = 900;
 	Rasterizer rasterizer(w, h);
+	rasterizer.setThreadCount(thread_count);
+	rasterizer.setRasterKernel(raster_kernel);
+	rasterizer.setShadingMode(shading_mode);
+	rasterizer.setBatchShading(batch_shading);
 
 	Vec3 pos(-3, 8, -5);
 	Vec3 center(0.0, 5.0, 0.0);
 	Vec3 up(0.0, 1.0, 0.0);	
 	rasterizer.setView(view(pos, center, up));
 	rasterizer.setProjection(perspective(80, (float)w/(float)h, 0.1, 50));
+	rasterizer.setLights({
+		Shader::Light{ {-20, 20, -20}, {500, 500, 500} },
+		Shader::Light{ {-20, 20, 0}, {500, 500, 500} }
+	});
 	
 	// Load skybox
 	Skybox skybox;
 	Skybox* skybox_ptr = nullptr;
-	if (skybox.loadFromFile("../res/skyboxes/HdrOutdoorFieldBaseballDayClear001/HdrOutdoorFieldBaseballDayClear001_JPG_4K.JPG")) {
+	if (skybox.loadFromFile(skybox_file)) {
 		rasterizer.setSkybox(skybox);
 		skybox_ptr = &skybox;
 	}
 	
 	// Set PBR shader
 	Shader shader;
-	rasterizer.setFragmentShader(
-		[&shader, skybox_ptr](const Shader::FragmentPayload& fragment_payload, const std::vector<Shader::Light>& lights) {
-			return shader.pbrShader(fragment_payload, lights, skybox_ptr);
-		}
-	);
+	shader.setPBRMath(pbr_math);
+	rasterizer.setPBRShader(&shader);
 	
 	// Load PBR materials
-	PBRMaterial metal_material = loadPBRMaterial("../res/materials/Poliigon_MetalPaintedMatte_7037/1K");
-	PBRMaterial stone_material = loadPBRMaterial("../res/materials/Poliigon_StoneQuartzite_8060/1K");
+	PBRMaterial metal_material, stone_material;
+	auto load_materials = [&](TextureLayout layout) {
+		metal_material = loadPBRMaterial("../res/materials/Poliigon_MetalPaintedMatte_7037/1K", layout);
+		stone_material = loadPBRMaterial("../res/materials/Poliigon_StoneQuartzite_8060/1K", layout);
+	};
+	load_materials(texture_layout);
 	
 	// Load cube geometry
-	objl::Loader loader;
-	bool loadout = false;
-	try {
-		loadout = loader.LoadFile("../res/objects/test.obj");
-	} catch (const std::exception& e) {
-		std::cerr << "Error loading OBJ file: " << e.what() << std::endl;
+	Mesh testobj_mesh;
+	if (!readOBJCached("../res/objects/test.obj", testobj_mesh)) {
+		std::cerr << "Failed to load OBJ file: ../res/objects/test.obj" << std::endl;
 		return 1;
 	}
+
+	auto draw_scene = [&](Rasterizer& rasterizer) {
+		// Draw first object with metal material (left)
+		Vec3 angles1(0, 0, 0);
+		Vec3 axis1(0, 0, 0);
+		Mat4 model1 = model(angles1, axis1);
+		Mat4 translation1;
+		translation1 << 
+			1, 0, 0, -1.5,
+			0, 1, 0, 5.0,
+			0, 0, 1, 0,
+			0, 0, 0, 1;
+		rasterizer.setModel(translation1 * model1);
+		rasterizer.setPBRMaterial(&stone_material);
+		rasterizer.drawMesh(testobj_mesh);
 	
-	if (!loadout) {
-		std::cerr << "Failed to load OBJ file: ../res/objects/cube.obj" << std::endl;
-		return 1;
-	}
+		// Draw second object with stone material (right)
+		Vec3 angles2(0, 0, 0);
+		Vec3 axis2(0, 0, 0);
+		Mat4 model2 = model(angles2, axis2);
+		Mat4 translation2;
+		translation2 << 
+			1, 0, 0, 1.5,
+			0, 1, 0, 5.0,
+			0, 0, 1, 0,
+			0, 0, 0, 1;
+		rasterizer.setModel(translation2 * model2);
+		rasterizer.setPBRMaterial(&metal_material);
+		rasterizer.drawMesh(testobj_mesh);
 	
-	vector<Triangle*> testobj_triangles;
-	for (auto mesh : loader.LoadedMeshes) {
-		for (int i = 0; i < mesh.Vertices.size(); i += 3) {
-			Triangle* t = new Triangle();
-			for (int j = 0; j < 3; j++) {
-				t->setVertex(j, Vec3(mesh.Vertices[i + j].Position.X,
-					mesh.Vertices[i + j].Position.Y,
-					mesh.Vertices[i + j].Position.Z));
-				t->setNormal(j, Vec3(mesh.Vertices[i + j].Normal.X,
-					mesh.Vertices[i + j].Normal.Y,
-					mesh.Vertices[i + j].Normal.Z));
-				t->setTextCoord(j, Vec2(mesh.Vertices[i + j].TextureCoordinate.X,
-					mesh.Vertices[i + j].TextureCoordinate.Y));
-			}
-			testobj_triangles.push_back(t);
+		// Draw skybox (should be drawn after geometry for proper depth testing)
+		rasterizer.drawSkybox();
+	};
+
+	// same objects turned away from the camera, texture lookups no longer run along the image rows
+	auto draw_rotated_scene = [&](Rasterizer& rasterizer) {
+		Mat4 translation = Mat4::Identity();
+		translation(1, 3) = 5.0;
+		translation(0, 3) = -1.5;
+		rasterizer.setModel(translation * model(Vec3(30, 45, 15), Vec3(0, 0, 0)));
+		rasterizer.setPBRMaterial(&stone_material);
+		rasterizer.drawMesh(testobj_mesh);
+		translation(0, 3) = 1.5;
+		rasterizer.setModel(translation * model(Vec3(-20, -60, 30), Vec3(0, 0, 0)));
+		rasterizer.setPBRMaterial(&metal_material);
+		rasterizer.drawMesh(testobj_mesh);
+		rasterizer.drawSkybox();
+	};
+
+	if (run_benchmark) {
+		// the android model, scaled to 3 units and centered where the camera looks, for many small triangles
+		Mesh android_mesh;
+		if (!readOBJCached("../res/objects/android.obj", android_mesh)) {
+			std::cerr << "Failed to load OBJ file: ../res/objects/android.obj" << std::endl;
+			return 1;
 		}
+		Vec3 android_size = android_mesh.bounds_max - android_mesh.bounds_min;
+		float android_scale = 3.0f / max(android_size.maxCoeff(), 1e-6f);
+		Mat4 android_model = Mat4::Identity();
+		android_model.topLeftCorner<3, 3>() *= android_scale;
+		android_model.topRightCorner<3, 1>() = Vec3(0, 5, 0) - android_scale * (android_mesh.bounds_min + android_mesh.bounds_max) / 2;
+		auto draw_android_scene = [&](Rasterizer& rasterizer) {
+			rasterizer.setModel(android_model);
+			rasterizer.setPBRMaterial(&metal_material);
+			rasterizer.drawMesh(android_mesh);
+			rasterizer.drawSkybox();
+		};
+
+		benchmarkThreadScaling(rasterizer, draw_scene);
+		benchmarkRasterKernels(rasterizer, { { "test", draw_scene }, { "android", draw_android_scene } });
+		benchmarkShadingModes(rasterizer, draw_scene);
+		benchmarkTextureLayouts(rasterizer, draw_rotated_scene, load_materials);
+		benchmarkPBRMath(rasterizer, { { "front", draw_scene }, { "rotated", draw_rotated_scene } },
+			[&shader](Shader::PBRMath math) { shader.setPBRMath(math); });
+		benchmarkBatchShading(rasterizer, { { "front", draw_scene }, { "rotated", draw_rotated_scene } });
+		benchmarkLightCulling(rasterizer, draw_scene);
+		benchmarkShaderVariants(shader, &metal_material, skybox_ptr);
+		Mat4 translation = Mat4::Identity();
+		translation(1, 3) = 5.0;
+		benchmarkMeshDraw(rasterizer, testobj_mesh, translation);
+		return 0;
 	}
 
-	// Draw first object with metal material (left)
-	Vec3 angles1(0, 0, 0);
-	Vec3 axis1(0, 0, 0);
-	Mat4 model1 = model(angles1, axis1);
-	Mat4 translation1;
-	translation1 << 
-		1, 0, 0, -1.5,
-		0, 1, 0, 5.0,
-		0, 0, 1, 0,
-		0, 0, 0, 1;
-	rasterizer.setModel(translation1 * model1);
-	rasterizer.setPBRMaterial(&stone_material);
-	for (auto& t : testobj_triangles)
-		rasterizer.drawTriangle(*t);
-	
-	// Draw second object with stone material (right)
-	Vec3 angles2(0, 0, 0);
-	Vec3 axis2(0, 0, 0);
-	Mat4 model2 = model(angles2, axis2);
-	Mat4 translation2;
-	translation2 << 
-		1, 0, 0, 1.5,
-		0, 1, 0, 5.0,
-		0, 0, 1, 0,
-		0, 0, 0, 1;
-	rasterizer.setModel(translation2 * model2);
-	rasterizer.setPBRMaterial(&metal_material);
-	for (auto& t : testobj_triangles)
-		rasterizer.drawTriangle(*t);
-	
-	// Draw skybox (should be drawn after geometry for proper depth testing)
-	rasterizer.drawSkybox();
+	draw_scene(rasterizer);
 
 	// Save result
 	cv::imwrite("../output/output.png", rasterizer.getPixels());
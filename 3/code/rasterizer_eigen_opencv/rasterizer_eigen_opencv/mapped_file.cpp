@@ -0,0 +1,98 @@
+// Disable std::byte to avoid conflict with Windows SDK
+#define _HAS_STD_BYTE 0
+
+#include "mapped_file.hpp"
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile() : bytes(nullptr), length(0)
+#ifdef _WIN32
+	, file_handle(nullptr), mapping_handle(nullptr)
+#endif
+{}
+
+MappedFile::~MappedFile() {
+	close();
+}
+
+#ifdef _WIN32
+
+bool MappedFile::open(const string& filename) {
+	close();
+	HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER file_size;
+	if (!GetFileSizeEx(file, &file_size)) {
+		CloseHandle(file);
+		return false;
+	}
+	file_handle = file;
+	length = (size_t)file_size.QuadPart;
+	if (length == 0) // an empty file cannot be mapped, it is an empty range
+		return true;
+
+	mapping_handle = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (mapping_handle)
+		bytes = (const char*)MapViewOfFile(mapping_handle, FILE_MAP_READ, 0, 0, 0);
+	if (!bytes) {
+		close();
+		return false;
+	}
+	return true;
+}
+
+void MappedFile::close() {
+	if (bytes)
+		UnmapViewOfFile(bytes);
+	if (mapping_handle)
+		CloseHandle(mapping_handle);
+	if (file_handle)
+		CloseHandle(file_handle);
+	bytes = nullptr;
+	length = 0;
+	file_handle = mapping_handle = nullptr;
+}
+
+#else
+
+bool MappedFile::open(const string& filename) {
+	close();
+	int fd = ::open(filename.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat info;
+	if (fstat(fd, &info) != 0) {
+		::close(fd);
+		return false;
+	}
+	length = (size_t)info.st_size;
+	if (length > 0) {
+		void* mapping = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (mapping == MAP_FAILED) {
+			::close(fd);
+			length = 0;
+			return false;
+		}
+		madvise(mapping, length, MADV_SEQUENTIAL);
+		bytes = (const char*)mapping;
+	}
+	::close(fd); // the mapping keeps the file referenced
+	return true;
+}
+
+void MappedFile::close() {
+	if (bytes)
+		munmap((void*)bytes, length);
+	bytes = nullptr;
+	length = 0;
+}
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef RASTERIZER_MAPPED_FILE_H
+#define RASTERIZER_MAPPED_FILE_H
+
+#include <cstddef>
+#include <string>
+
+using namespace std;
+
+// Read-only memory mapping of a whole file: the pages are read by the OS on first access,
+// nothing is copied into a buffer
+class MappedFile {
+public:
+	MappedFile();
+	~MappedFile();
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	bool open(const string& filename); // false if the file cannot be opened or mapped
+	void close();
+
+	const char* data() const { return bytes; }
+	size_t size() const { return length; }
+
+private:
+	const char* bytes;
+	size_t length;
+#ifdef _WIN32
+	void* file_handle;
+	void* mapping_handle;
+#endif
+};
+
+#endif
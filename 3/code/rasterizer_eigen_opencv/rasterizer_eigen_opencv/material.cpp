@@ -6,6 +6,7 @@
 #include <fstream>
 #include <algorithm>
 #include <sstream>
+#include <cmath>
 #include <opencv2/opencv.hpp>
 #ifdef _WIN32
 #include <windows.h>
@@ -190,14 +191,14 @@ string findTextureFile(const string& dir, const vector<string>& patterns) {
 	return "";
 }
 
-PBRMaterial loadPBRMaterial(const string& materialPath) {
+PBRMaterial loadPBRMaterial(const string& materialPath, TextureLayout layout) {
 	PBRMaterial mat;
 	
 	vector<string> albedo_patterns = {"basecolor", "albedo", "_col_", "_color", "_diffuse"};
 	string albedo_file = findTextureFile(materialPath, albedo_patterns);
 	if (!albedo_file.empty()) {
 		try {
-			mat.albedo_map = Texture(albedo_file);
+			mat.albedo_map = Texture(albedo_file, TextureFormat::RGBA8, layout);
 		} catch (...) {
 			// Failed to load texture
 		}
@@ -208,7 +209,7 @@ PBRMaterial loadPBRMaterial(const string& materialPath) {
 	string normal_file = findTextureFile(materialPath, normal_patterns);
 	if (!normal_file.empty()) {
 		try {
-			mat.normal_map = Texture(normal_file);
+			mat.normal_map = Texture(normal_file, TextureFormat::RGBA8, layout);
 		} catch (...) {
 		}
 	}
@@ -218,7 +219,7 @@ PBRMaterial loadPBRMaterial(const string& materialPath) {
 	string metallic_file = findTextureFile(materialPath, metallic_patterns);
 	if (!metallic_file.empty()) {
 		try {
-			mat.metallic_map = Texture(metallic_file);
+			mat.metallic_map = Texture(metallic_file, TextureFormat::R8);
 		} catch (...) {
 		}
 	}
@@ -228,7 +229,7 @@ PBRMaterial loadPBRMaterial(const string& materialPath) {
 	string roughness_file = findTextureFile(materialPath, roughness_patterns);
 	if (!roughness_file.empty()) {
 		try {
-			mat.roughness_map = Texture(roughness_file);
+			mat.roughness_map = Texture(roughness_file, TextureFormat::R8);
 		} catch (...) {
 		}
 	}
@@ -238,10 +239,47 @@ PBRMaterial loadPBRMaterial(const string& materialPath) {
 	string ao_file = findTextureFile(materialPath, ao_patterns);
 	if (!ao_file.empty()) {
 		try {
-			mat.ao_map = Texture(ao_file);
+			mat.ao_map = Texture(ao_file, TextureFormat::R8);
 		} catch (...) {
 		}
 	}
+
+	packORMMap(mat, layout);
 	
 	return mat;
+}
+
+void packORMMap(PBRMaterial& material, TextureLayout layout) {
+	// R: AO, G: roughness, B: metallic, channels without a map hold the base value
+	optional<Texture>* maps[3] = { &material.ao_map, &material.roughness_map, &material.metallic_map };
+	float base[3] = { 1.0f, material.roughness, material.metallic };
+
+	// pack at the size of the largest map
+	int width = 0, height = 0;
+	for (auto slot : maps) {
+		if (slot->has_value()) {
+			width = max(width, (*slot)->w());
+			height = max(height, (*slot)->h());
+		}
+	}
+	if (width == 0 || height == 0)
+		return;
+
+	cv::Mat orm(height, width, CV_8UC3);
+	for (int c = 0; c < 3; c++) {
+		cv::Mat channel;
+		if (maps[c]->has_value()) {
+			channel = (*maps[c])->image(0);
+			if (channel.cols != width || channel.rows != height)
+				cv::resize(channel, channel, cv::Size(width, height), 0, 0, cv::INTER_LINEAR);
+		}
+		uchar base_value = (uchar)std::clamp((int)lround(base[c] * 255.0f), 0, 255);
+		for (int y = 0; y < height; y++)
+			for (int x = 0; x < width; x++)
+				orm.at<cv::Vec3b>(y, x)[c] = channel.empty() ? base_value : channel.at<uchar>(y, x);
+	}
+
+	material.orm_map = Texture(orm, TextureFormat::RGBA8, layout);
+	for (auto slot : maps)
+		slot->reset();
 }
\ No newline at end of file
@@ -35,6 +35,7 @@ public:
 	optional<Texture> metallic_map;    // Metallic map
 	optional<Texture> roughness_map;   // Roughness map
 	optional<Texture> ao_map;          // Ambient occlusion map
+	optional<Texture> orm_map;         // AO, roughness and metallic packed in R, G and B
 	
 	// Base values (used when maps are not available)
 	Vec3 albedo;      // Base color (default: white)
@@ -47,12 +48,14 @@ public:
 	bool hasMetallicMap() const { return metallic_map.has_value(); }
 	bool hasRoughnessMap() const { return roughness_map.has_value(); }
 	bool hasAOMap() const { return ao_map.has_value(); }
+	bool hasORMMap() const { return orm_map.has_value(); }
 };
 
 extern map<string, Material> all_materials;
 extern map<string, PBRMaterial> all_pbr_materials;
 
 void loadMaterials(const string& filename);
-PBRMaterial loadPBRMaterial(const string& materialPath);
+PBRMaterial loadPBRMaterial(const string& materialPath, TextureLayout layout = TextureLayout::Linear); // scalar maps end up packed in orm_map
+void packORMMap(PBRMaterial& material, TextureLayout layout = TextureLayout::Linear); // pack the R8 AO, roughness and metallic maps into orm_map
 
 #endif
@@ -0,0 +1,284 @@
+#include "mesh.hpp"
+#include "OBJ_Loader.h"
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
+Mesh::Mesh() : bounds_min(0, 0, 0), bounds_max(0, 0, 0) {}
+
+Mesh::Mesh(const objl::Loader& loader) {
+	size_t count = loader.LoadedVertices.size();
+	pos_x.reserve(count); pos_y.reserve(count); pos_z.reserve(count);
+	normal_x.reserve(count); normal_y.reserve(count); normal_z.reserve(count);
+	u.reserve(count); v.reserve(count);
+	for (const objl::Vertex& vertex : loader.LoadedVertices)
+		addVertex(Vec3(vertex.Position.X, vertex.Position.Y, vertex.Position.Z),
+			Vec3(vertex.Normal.X, vertex.Normal.Y, vertex.Normal.Z),
+			Vec2(vertex.TextureCoordinate.X, vertex.TextureCoordinate.Y));
+	indices.assign(loader.LoadedIndices.begin(), loader.LoadedIndices.end());
+
+	// every face adds the same indices to its mesh and to LoadedIndices, so the meshes are consecutive runs
+	uint32_t first_index = 0;
+	for (const objl::Mesh& mesh : loader.LoadedMeshes) {
+		submeshes.push_back(SubMesh{ mesh.MeshName, mesh.MeshMaterial.name, first_index, (uint32_t)mesh.Indices.size(), Vec3(0, 0, 0), Vec3(0, 0, 0) });
+		first_index += (uint32_t)mesh.Indices.size();
+	}
+	computeBounds();
+}
+
+int Mesh::vertexCount() const {
+	return (int)pos_x.size();
+}
+
+int Mesh::triangleCount() const {
+	return (int)(indices.size() / 3);
+}
+
+size_t Mesh::memoryBytes() const {
+	return vertexCount() * 8 * sizeof(float) + indices.size() * sizeof(uint32_t);
+}
+
+void Mesh::computeBounds() {
+	const float inf = numeric_limits<float>::infinity();
+	auto extend = [this](uint32_t i, Vec3& lo, Vec3& hi) {
+		Vec3 p = position(i);
+		lo = lo.cwiseMin(p);
+		hi = hi.cwiseMax(p);
+	};
+	auto finish = [](Vec3& lo, Vec3& hi) {
+		if (lo.x() > hi.x())
+			lo = hi = Vec3(0, 0, 0);
+	};
+
+	bounds_min = Vec3(inf, inf, inf);
+	bounds_max = -bounds_min;
+	for (int i = 0; i < vertexCount(); i++)
+		extend(i, bounds_min, bounds_max);
+	finish(bounds_min, bounds_max);
+	for (SubMesh& submesh : submeshes) {
+		submesh.bounds_min = Vec3(inf, inf, inf);
+		submesh.bounds_max = -submesh.bounds_min;
+		for (uint32_t i = submesh.first_index; i < submesh.first_index + submesh.index_count && i < indices.size(); i++)
+			extend(indices[i], submesh.bounds_min, submesh.bounds_max);
+		finish(submesh.bounds_min, submesh.bounds_max);
+	}
+}
+
+uint32_t Mesh::addVertex(const Vec3& pos, const Vec3& normal, const Vec2& text_coord) {
+	pos_x.push_back(pos.x()); pos_y.push_back(pos.y()); pos_z.push_back(pos.z());
+	normal_x.push_back(normal.x()); normal_y.push_back(normal.y()); normal_z.push_back(normal.z());
+	u.push_back(text_coord.x()); v.push_back(text_coord.y());
+	return (uint32_t)(pos_x.size() - 1);
+}
+
+Vec3 Mesh::position(uint32_t i) const {
+	return Vec3(pos_x[i], pos_y[i], pos_z[i]);
+}
+
+Vec3 Mesh::normal(uint32_t i) const {
+	return Vec3(normal_x[i], normal_y[i], normal_z[i]);
+}
+
+Vec2 Mesh::textCoord(uint32_t i) const {
+	return Vec2(u[i], v[i]);
+}
+
+Triangle Mesh::triangle(int t) const {
+	Triangle triangle;
+	for (int j = 0; j < 3; j++) {
+		uint32_t i = indices[t * 3 + j];
+		triangle.setVertex(j, position(i));
+		triangle.setNormal(j, normal(i));
+		triangle.setTextCoord(j, textCoord(i));
+	}
+	return triangle;
+}
+
+void Mesh::weldVertices() {
+	// open addressing hash table of the vertices kept so far, keyed by the bit patterns of the attributes
+	vector<vector<float>*> streams = { &pos_x, &pos_y, &pos_z, &normal_x, &normal_y, &normal_z, &u, &v };
+	size_t table_size = 1;
+	while (table_size < 2 * (size_t)vertexCount())
+		table_size *= 2;
+	vector<uint32_t> table(table_size, UINT32_MAX);
+	vector<uint32_t> remap(vertexCount());
+	uint32_t count = 0;
+	for (int i = 0; i < vertexCount(); i++) {
+		uint32_t bits[8];
+		uint64_t hash = 14695981039346656037ull; // FNV-1a over the words
+		for (int k = 0; k < 8; k++) {
+			float value = (*streams[k])[i] + 0.0f; // -0 becomes +0, the two compare equal
+			memcpy(&bits[k], &value, sizeof(float));
+			hash = (hash ^ bits[k]) * 1099511628211ull;
+		}
+		size_t slot = (size_t)(hash ^ (hash >> 32)) & (table_size - 1);
+		for (;; slot = (slot + 1) & (table_size - 1)) {
+			uint32_t kept = table[slot];
+			if (kept == UINT32_MAX) { // vertices only move to lower indices, so the arrays are compacted in place
+				for (vector<float>* stream : streams)
+					(*stream)[count] = (*stream)[i];
+				table[slot] = remap[i] = count++;
+				break;
+			}
+			bool same = true;
+			for (int k = 0; k < 8 && same; k++)
+				same = (*streams[k])[kept] == (*streams[k])[i];
+			if (same) {
+				remap[i] = kept;
+				break;
+			}
+		}
+	}
+	for (vector<float>* stream : streams) {
+		stream->resize(count);
+		stream->shrink_to_fit();
+	}
+	for (uint32_t& index : indices)
+		index = remap[index];
+}
+
+// Tipsify (Sander, Nehab and Barczak, "Fast triangle reordering for vertex locality and reduced
+// overdraw", 2007) on count / 3 triangles over the vertices 0 .. vertex_count - 1: fan out from a
+// vertex, emitting its remaining triangles, then continue with the vertex among those just used that
+// is still in the cache and has the most recent use, else with a dead end from the stack, else with
+// the next vertex in input order. Linear in the triangle count.
+static void tipsify(const uint32_t* indices, size_t count, int vertex_count, int cache_size, uint32_t* out) {
+	int triangle_count = (int)(count / 3);
+	if (triangle_count == 0)
+		return;
+	vector<int> live(vertex_count, 0); // triangles of the vertex not emitted yet
+	for (size_t i = 0; i < count; i++)
+		live[indices[i]]++;
+	vector<int> adjacency_start(vertex_count + 1, 0); // triangles of vertex v: adjacency[adjacency_start[v] ..]
+	for (int v = 0; v < vertex_count; v++)
+		adjacency_start[v + 1] = adjacency_start[v] + live[v];
+	vector<int> adjacency(count);
+	vector<int> filled(adjacency_start.begin(), adjacency_start.end() - 1);
+	for (size_t i = 0; i < count; i++)
+		adjacency[filled[indices[i]]++] = (int)(i / 3);
+
+	vector<int> cache_time(vertex_count, 0); // time stamp at which the vertex entered the cache
+	vector<char> emitted(triangle_count, 0);
+	vector<int> dead_ends, candidates;
+	int time = cache_size + 1; // every vertex starts out of the cache
+	int cursor = 1; // next vertex in input order to fan from when the dead end stack is empty
+	int fanning = 0;
+	while (fanning >= 0) {
+		candidates.clear();
+		for (int k = adjacency_start[fanning]; k < adjacency_start[fanning + 1]; k++) {
+			int t = adjacency[k];
+			if (emitted[t])
+				continue;
+			for (int j = 0; j < 3; j++) {
+				uint32_t v = indices[t * 3 + j];
+				*out++ = v;
+				dead_ends.push_back(v);
+				candidates.push_back(v);
+				live[v]--;
+				if (time - cache_time[v] > cache_size) { // a miss puts it into the cache
+					cache_time[v] = time;
+					time++;
+				}
+			}
+			emitted[t] = 1;
+		}
+
+		// the next fanning vertex: still has triangles, and stays in the cache while they are emitted
+		int best = -1, best_priority = -1;
+		for (int v : candidates) {
+			if (live[v] <= 0)
+				continue;
+			int priority = 0;
+			if (time - cache_time[v] + 2 * live[v] <= cache_size)
+				priority = time - cache_time[v];
+			if (priority > best_priority) {
+				best_priority = priority;
+				best = v;
+			}
+		}
+		while (best < 0 && !dead_ends.empty()) {
+			int v = dead_ends.back();
+			dead_ends.pop_back();
+			if (live[v] > 0)
+				best = v;
+		}
+		for (; best < 0 && cursor < vertex_count; cursor++)
+			if (live[cursor] > 0)
+				best = cursor;
+		fanning = best;
+	}
+}
+
+void Mesh::optimizeTriangleOrder(int cache_size) {
+	// each submesh on its own, over its vertices numbered locally in first use order
+	vector<int> local(vertexCount(), -1);
+	vector<uint32_t> global, local_indices, ordered;
+	auto optimizeRange = [&](uint32_t first, uint32_t count) {
+		global.clear();
+		local_indices.resize(count);
+		for (uint32_t i = 0; i < count; i++) {
+			uint32_t vertex = indices[first + i];
+			if (local[vertex] < 0) {
+				local[vertex] = (int)global.size();
+				global.push_back(vertex);
+			}
+			local_indices[i] = local[vertex];
+		}
+		ordered.resize(count);
+		tipsify(local_indices.data(), count, (int)global.size(), cache_size, ordered.data());
+		for (uint32_t i = 0; i < count; i++)
+			indices[first + i] = global[ordered[i]];
+		for (uint32_t vertex : global)
+			local[vertex] = -1;
+	};
+
+	uint32_t covered = 0; // triangles outside every submesh are ordered as one more range
+	for (const SubMesh& submesh : submeshes) {
+		uint32_t first = min(submesh.first_index, (uint32_t)indices.size());
+		uint32_t count = min(submesh.index_count, (uint32_t)indices.size() - first) / 3 * 3;
+		optimizeRange(first, count);
+		covered = max(covered, first + count);
+	}
+	if (submeshes.empty() || covered < indices.size())
+		optimizeRange(covered, ((uint32_t)indices.size() - covered) / 3 * 3);
+}
+
+void Mesh::optimizeVertexOrder() {
+	vector<uint32_t> remap(vertexCount(), UINT32_MAX);
+	vector<uint32_t> order; // old index of every new vertex
+	order.reserve(vertexCount());
+	for (uint32_t& index : indices) {
+		if (remap[index] == UINT32_MAX) {
+			remap[index] = (uint32_t)order.size();
+			order.push_back(index);
+		}
+		index = remap[index];
+	}
+	vector<float> reordered(order.size());
+	for (vector<float>* stream : { &pos_x, &pos_y, &pos_z, &normal_x, &normal_y, &normal_z, &u, &v }) {
+		for (size_t i = 0; i < order.size(); i++)
+			reordered[i] = (*stream)[order[i]];
+		stream->assign(reordered.begin(), reordered.end());
+	}
+}
+
+void Mesh::optimize(int cache_size) {
+	weldVertices();
+	optimizeTriangleOrder(cache_size);
+	optimizeVertexOrder();
+	computeBounds();
+}
+
+float Mesh::cacheMissRatio(int cache_size) const {
+	if (indices.size() < 3)
+		return 0.0f;
+	// a vertex is in the FIFO cache while fewer than cache_size misses followed its own
+	vector<int64_t> entered(vertexCount(), INT64_MIN / 2);
+	int64_t misses = 0;
+	for (uint32_t index : indices)
+		if (misses - entered[index] >= cache_size) {
+			entered[index] = misses;
+			misses++;
+		}
+	return (float)misses / triangleCount();
+}
@@ -0,0 +1,62 @@
+#ifndef RASTERIZER_MESH_H
+#define RASTERIZER_MESH_H
+
+#include "triangle.hpp"
+#include <Eigen/Eigen>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using namespace std;
+using Vec2 = Eigen::Vector2f;
+using Vec3 = Eigen::Vector3f;
+
+namespace objl { class Loader; }
+
+const int VERTEX_CACHE_SIZE = 16; // post-transform cache entries the triangle order is tuned for, as on GPUs
+
+// Indexed triangle list: every vertex is stored once and referenced by the triangles sharing it,
+// so a draw transforms it once (Rasterizer::drawMesh)
+class Mesh {
+public:
+	struct SubMesh { // a run of triangles of one OBJ group / material
+		string name;
+		string material;
+		uint32_t first_index;
+		uint32_t index_count;
+		Vec3 bounds_min, bounds_max; // of the vertices its triangles use, set by computeBounds
+	};
+
+	// vertex attributes, one array per component
+	vector<float> pos_x, pos_y, pos_z;
+	vector<float> normal_x, normal_y, normal_z;
+	vector<float> u, v;
+	vector<uint32_t> indices; // three per triangle, counter clockwise
+	vector<SubMesh> submeshes;
+	Vec3 bounds_min, bounds_max; // of all vertices, set by computeBounds
+
+	Mesh();
+	// the loader's LoadedVertices and LoadedIndices, one submesh per entry of LoadedMeshes
+	explicit Mesh(const objl::Loader& loader);
+
+	int vertexCount() const;
+	int triangleCount() const;
+	size_t memoryBytes() const; // vertex and index arrays
+	void computeBounds(); // axis aligned boxes of the mesh and the submeshes, zero when empty
+
+	// processing after loading; triangles stay in their submesh and keep their winding
+	void weldVertices(); // merge vertices with the same position, normal and texture coordinate
+	void optimizeTriangleOrder(int cache_size = VERTEX_CACHE_SIZE); // Tipsify order of each submesh's triangles
+	void optimizeVertexOrder(); // number the vertices in the order the triangles first use them, unused ones dropped
+	void optimize(int cache_size = VERTEX_CACHE_SIZE); // all three, in that order
+	// average cache miss ratio: vertices a FIFO post-transform cache of cache_size entries transforms per triangle
+	float cacheMissRatio(int cache_size = VERTEX_CACHE_SIZE) const;
+
+	uint32_t addVertex(const Vec3& pos, const Vec3& normal, const Vec2& text_coord);
+	Vec3 position(uint32_t i) const;
+	Vec3 normal(uint32_t i) const;
+	Vec2 textCoord(uint32_t i) const;
+	Triangle triangle(int t) const; // triangle t with its attributes copied out
+};
+
+#endif
@@ -0,0 +1,188 @@
+#include "mesh_cache.hpp"
+#include "mapped_file.hpp"
+#include "obj_reader.hpp"
+#include <array>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+
+struct MeshCacheHeader {
+	char magic[4];
+	uint32_t version;
+	uint64_t source_size;  // bytes of the OBJ file
+	int64_t source_mtime;  // modification time of the OBJ file in file clock ticks
+	uint64_t file_size;    // bytes of the cache, a truncated cache is rejected
+	uint32_t path_size;    // bytes of the OBJ path, which follows the header
+	uint32_t vertex_count;
+	uint32_t index_count;
+	uint32_t submesh_count;
+	uint64_t streams_offset;   // pos_x, pos_y, pos_z, normal_x, normal_y, normal_z, u, v, vertex_count floats each
+	uint64_t indices_offset;   // index_count uint32
+	uint64_t submeshes_offset; // a SubMeshRecord per submesh
+	uint64_t strings_offset;   // submesh names and materials
+	uint64_t strings_size;
+	float bounds_min[3], bounds_max[3];
+};
+
+struct SubMeshRecord {
+	uint32_t first_index, index_count;
+	uint32_t name_offset, name_size; // in the strings section
+	uint32_t material_offset, material_size;
+	float bounds_min[3], bounds_max[3];
+};
+
+static const char MESH_CACHE_MAGIC[4] = { 'R', 'M', 'S', 'H' };
+
+static uint64_t align16(uint64_t offset) {
+	return (offset + 15) & ~(uint64_t)15;
+}
+
+// a section of size bytes at offset lies in the file and is aligned as saveMeshCache writes it; the
+// length is compared with the space left after the offset, so a damaged offset cannot wrap around
+static bool sectionFits(uint64_t offset, uint64_t size, uint64_t file_size) {
+	return offset % 16 == 0 && offset <= file_size && size <= file_size - offset;
+}
+
+// the key of the cache besides the path: size and modification time of the OBJ file
+static bool sourceStamp(const string& filename, uint64_t& size, int64_t& mtime) {
+	error_code error;
+	size = (uint64_t)filesystem::file_size(filename, error);
+	if (error)
+		return false;
+	auto time = filesystem::last_write_time(filename, error);
+	if (error)
+		return false;
+	mtime = (int64_t)time.time_since_epoch().count();
+	return true;
+}
+
+template <class M>
+static auto vertexStreams(M& mesh) { // in file order
+	return array{ &mesh.pos_x, &mesh.pos_y, &mesh.pos_z, &mesh.normal_x, &mesh.normal_y, &mesh.normal_z, &mesh.u, &mesh.v };
+}
+
+static void storeBounds(const Vec3& lo, const Vec3& hi, float* bounds_min, float* bounds_max) {
+	for (int i = 0; i < 3; i++) {
+		bounds_min[i] = lo[i];
+		bounds_max[i] = hi[i];
+	}
+}
+
+bool loadMeshCache(const string& filename, Mesh& mesh) {
+	MappedFile file;
+	if (!file.open(filename + ".mesh") || file.size() < sizeof(MeshCacheHeader))
+		return false;
+	const char* data = file.data();
+	MeshCacheHeader header;
+	memcpy(&header, data, sizeof(header));
+
+	uint64_t source_size;
+	int64_t source_mtime;
+	if (memcmp(header.magic, MESH_CACHE_MAGIC, 4) != 0 || header.version != MESH_CACHE_VERSION || header.file_size != file.size() ||
+		!sourceStamp(filename, source_size, source_mtime) || header.source_size != source_size || header.source_mtime != source_mtime)
+		return false;
+	if (header.path_size != filename.size() || sizeof(header) + header.path_size > file.size() ||
+		memcmp(data + sizeof(header), filename.data(), filename.size()) != 0)
+		return false;
+
+	uint64_t vertex_count = header.vertex_count, index_count = header.index_count;
+	if (!sectionFits(header.streams_offset, 8 * vertex_count * sizeof(float), file.size()) ||
+		!sectionFits(header.indices_offset, index_count * sizeof(uint32_t), file.size()) ||
+		!sectionFits(header.submeshes_offset, (uint64_t)header.submesh_count * sizeof(SubMeshRecord), file.size()) ||
+		!sectionFits(header.strings_offset, header.strings_size, file.size()))
+		return false;
+
+	Mesh loaded; // the caller's mesh is only replaced once the whole cache checked out
+	const float* stream = (const float*)(data + header.streams_offset);
+	for (vector<float>* s : vertexStreams(loaded)) {
+		s->assign(stream, stream + vertex_count);
+		stream += vertex_count;
+	}
+	const uint32_t* indices = (const uint32_t*)(data + header.indices_offset);
+	loaded.indices.assign(indices, indices + index_count);
+	for (uint32_t i : loaded.indices)
+		if (i >= vertex_count)
+			return false;
+
+	const char* strings = data + header.strings_offset;
+	for (uint32_t i = 0; i < header.submesh_count; i++) {
+		SubMeshRecord record;
+		memcpy(&record, data + header.submeshes_offset + i * sizeof(SubMeshRecord), sizeof(record));
+		if ((uint64_t)record.name_offset + record.name_size > header.strings_size ||
+			(uint64_t)record.material_offset + record.material_size > header.strings_size ||
+			(uint64_t)record.first_index + record.index_count > index_count)
+			return false;
+		loaded.submeshes.push_back(Mesh::SubMesh{
+			string(strings + record.name_offset, record.name_size), string(strings + record.material_offset, record.material_size),
+			record.first_index, record.index_count,
+			Vec3(record.bounds_min[0], record.bounds_min[1], record.bounds_min[2]),
+			Vec3(record.bounds_max[0], record.bounds_max[1], record.bounds_max[2]) });
+	}
+	loaded.bounds_min = Vec3(header.bounds_min[0], header.bounds_min[1], header.bounds_min[2]);
+	loaded.bounds_max = Vec3(header.bounds_max[0], header.bounds_max[1], header.bounds_max[2]);
+	mesh = move(loaded);
+	return true;
+}
+
+bool saveMeshCache(const string& filename, const Mesh& mesh) {
+	MeshCacheHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, MESH_CACHE_MAGIC, 4);
+	header.version = MESH_CACHE_VERSION;
+	if (!sourceStamp(filename, header.source_size, header.source_mtime))
+		return false;
+	header.path_size = (uint32_t)filename.size();
+	header.vertex_count = (uint32_t)mesh.vertexCount();
+	header.index_count = (uint32_t)mesh.indices.size();
+	header.submesh_count = (uint32_t)mesh.submeshes.size();
+	storeBounds(mesh.bounds_min, mesh.bounds_max, header.bounds_min, header.bounds_max);
+
+	string strings;
+	vector<SubMeshRecord> records;
+	for (const Mesh::SubMesh& submesh : mesh.submeshes) {
+		SubMeshRecord record;
+		record.first_index = submesh.first_index;
+		record.index_count = submesh.index_count;
+		record.name_offset = (uint32_t)strings.size();
+		record.name_size = (uint32_t)submesh.name.size();
+		strings += submesh.name;
+		record.material_offset = (uint32_t)strings.size();
+		record.material_size = (uint32_t)submesh.material.size();
+		strings += submesh.material;
+		storeBounds(submesh.bounds_min, submesh.bounds_max, record.bounds_min, record.bounds_max);
+		records.push_back(record);
+	}
+
+	header.streams_offset = align16(sizeof(header) + header.path_size);
+	header.indices_offset = align16(header.streams_offset + 8 * (uint64_t)header.vertex_count * sizeof(float));
+	header.submeshes_offset = align16(header.indices_offset + (uint64_t)header.index_count * sizeof(uint32_t));
+	header.strings_offset = align16(header.submeshes_offset + records.size() * sizeof(SubMeshRecord));
+	header.strings_size = strings.size();
+	header.file_size = header.strings_offset + header.strings_size;
+
+	// the whole file is assembled in memory and written at once
+	vector<char> buffer(header.file_size, 0);
+	memcpy(buffer.data(), &header, sizeof(header));
+	memcpy(buffer.data() + sizeof(header), filename.data(), filename.size());
+	char* stream = buffer.data() + header.streams_offset;
+	for (const vector<float>* s : vertexStreams(mesh)) {
+		memcpy(stream, s->data(), s->size() * sizeof(float));
+		stream += s->size() * sizeof(float);
+	}
+	memcpy(buffer.data() + header.indices_offset, mesh.indices.data(), mesh.indices.size() * sizeof(uint32_t));
+	memcpy(buffer.data() + header.submeshes_offset, records.data(), records.size() * sizeof(SubMeshRecord));
+	memcpy(buffer.data() + header.strings_offset, strings.data(), strings.size());
+
+	ofstream file(filename + ".mesh", ios::binary);
+	return (bool)file.write(buffer.data(), buffer.size());
+}
+
+bool readOBJCached(const string& filename, Mesh& mesh, int thread_count) {
+	if (loadMeshCache(filename, mesh))
+		return true;
+	if (!readOBJ(filename, mesh, thread_count))
+		return false;
+	mesh.optimize();
+	saveMeshCache(filename, mesh);
+	return true;
+}
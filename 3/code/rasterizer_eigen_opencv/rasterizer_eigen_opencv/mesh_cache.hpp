@@ -0,0 +1,24 @@
+#ifndef RASTERIZER_MESH_CACHE_H
+#define RASTERIZER_MESH_CACHE_H
+
+#include "mesh.hpp"
+#include <string>
+
+using namespace std;
+
+// Binary mesh cache <filename>.mesh next to the OBJ file: a versioned header naming the OBJ path, size
+// and modification time, the eight vertex streams, the index buffer, the submesh table with materials and
+// bounds, and the names. The sections are 16-byte aligned in native byte order, so a load maps the file
+// and copies every stream out of the mapping in one pass.
+const uint32_t MESH_CACHE_VERSION = 2; // 2: meshes are cached after Mesh::optimize
+
+// load the cache of the OBJ file; false, leaving mesh unchanged, if there is none, it is damaged or it
+// was written for another version of the file or of the format
+bool loadMeshCache(const string& filename, Mesh& mesh);
+bool saveMeshCache(const string& filename, const Mesh& mesh);
+
+// readOBJ through the cache: the cache if it is current, otherwise the OBJ file, optimized with
+// Mesh::optimize before the cache is written
+bool readOBJCached(const string& filename, Mesh& mesh, int thread_count = 0);
+
+#endif
@@ -0,0 +1,586 @@
+#include "obj_reader.hpp"
+#include "mapped_file.hpp"
+#include "thread_pool.hpp"
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <climits>
+#include <cstring>
+
+const int NO_INDEX = INT_MIN;
+const size_t MIN_CHUNK_BYTES = 256 * 1024; // smaller files are not worth splitting further
+enum : unsigned char { RELATIVE_POSITION = 1, RELATIVE_TEXT_COORD = 2, RELATIVE_NORMAL = 4 };
+
+struct Corner { // indices of one face corner, 0-based, NO_INDEX: not given
+	int position, text_coord, normal;
+	unsigned char relative; // RELATIVE_* bits of the indices that were negative in the file, they lack the chunk offset
+};
+
+struct GroupRecord { // an o / g / usemtl line, replayed in file order by the merge to split the faces into submeshes
+	enum class Kind { Group, UnnamedGroup, Material } kind; // UnnamedGroup: any other line starting with g
+	string name; // the rest of the line
+	size_t face; // faces of the chunk before the line
+	uint32_t index; // indices of the chunk before the line, set when the faces are triangulated
+};
+
+struct OBJChunk { // the records of a range of whole lines, parsed by one thread
+	const char* begin;
+	const char* end;
+	vector<Vec3> positions, normals;
+	vector<Vec2> text_coords;
+	vector<Corner> corners;
+	vector<uint32_t> face_sizes; // corners of each face, faces with less than 3 are dropped
+	vector<GroupRecord> groups;
+	vector<uint32_t> indices; // triangles, numbering the vertices of the whole mesh
+	size_t position_offset, text_coord_offset, normal_offset, vertex_offset; // elements in the chunks before
+	bool valid;
+};
+
+struct RecordCounts { // sizes for the arrays, from the counting pass
+	size_t positions = 0, text_coords = 0, normals = 0;
+	size_t faces = 0, corners = 0;
+};
+
+static bool isBlank(char c) {
+	return c == ' ' || c == '\t';
+}
+
+static const char* skipBlanks(const char* p, const char* end) {
+	while (p < end && isBlank(*p))
+		p++;
+	return p;
+}
+
+static const char* skipToken(const char* p, const char* end) {
+	while (p < end && !isBlank(*p))
+		p++;
+	return p;
+}
+
+// end of the line starting at p without the line break, next is set to the start of the next line
+static const char* lineEnd(const char* p, const char* end, const char*& next) {
+	const char* newline = (const char*)memchr(p, '\n', end - p);
+	next = newline ? newline + 1 : end;
+	const char* line_end = newline ? newline : end;
+	if (line_end > p && line_end[-1] == '\r')
+		line_end--;
+	return line_end;
+}
+
+static bool isKeyword(const char* token, const char* token_end, const char* keyword) {
+	size_t length = strlen(keyword);
+	return (size_t)(token_end - token) == length && memcmp(token, keyword, length) == 0;
+}
+
+// the rest of the line after the keyword, blanks trimmed on both sides like objl's tail()
+static string tail(const char* keyword_end, const char* line_end) {
+	const char* p = skipBlanks(keyword_end, line_end);
+	while (line_end > p && isBlank(line_end[-1]))
+		line_end--;
+	return string(p, line_end);
+}
+
+static bool parseFloat(const char*& p, const char* end, float& value) {
+	p = skipBlanks(p, end);
+	if (p < end && *p == '+') // accepted by stof, not by from_chars
+		p++;
+	from_chars_result result = from_chars(p, end, value);
+	if (result.ec != errc())
+		return false;
+	p = result.ptr;
+	return true;
+}
+
+// a 1-based index or a negative one, counted back from the last of the count elements the chunk has read
+// so far, made 0-based; the flag is added to relative for a negative one. Range checks follow in the merge
+static bool parseIndex(const char*& p, const char* end, size_t count, int& index, unsigned char& relative, unsigned char flag) {
+	if (p < end && *p == '+')
+		p++;
+	int value;
+	from_chars_result result = from_chars(p, end, value);
+	if (result.ec != errc() || value == 0)
+		return false;
+	p = result.ptr;
+	if (value < 0) {
+		index = (int)count + value;
+		relative |= flag;
+	}
+	else
+		index = value - 1;
+	return true;
+}
+
+static RecordCounts countRecords(const char* p, const char* end) {
+	RecordCounts counts;
+	while (p < end) {
+		const char* next;
+		const char* line_end = lineEnd(p, end, next);
+		const char* token = skipBlanks(p, line_end);
+		const char* token_end = skipToken(token, line_end);
+		if (isKeyword(token, token_end, "v"))
+			counts.positions++;
+		else if (isKeyword(token, token_end, "vt"))
+			counts.text_coords++;
+		else if (isKeyword(token, token_end, "vn"))
+			counts.normals++;
+		else if (isKeyword(token, token_end, "f")) {
+			counts.faces++;
+			for (const char* q = skipBlanks(token_end, line_end); q < line_end; q = skipBlanks(skipToken(q, line_end), line_end))
+				counts.corners++;
+		}
+		p = next;
+	}
+	return counts;
+}
+
+struct PolygonScratch { // buffers of triangulatePolygon, reused from face to face
+	vector<Vec2> points;     // corners projected onto the polygon plane, counter clockwise
+	vector<int> prev, next;  // the corners not clipped yet, as a circular linked list
+	vector<char> reflex;     // corner is not convex (reflex or collinear with its neighbours)
+	vector<int> reflex_list; // reflex corners, the only ones that can lie inside an ear
+	vector<int> cell_start;  // the reflex corners bucketed into a grid over their bounding box,
+	vector<int> cell_items;  // cell c holds cell_items[cell_start[c] .. cell_start[c + 1])
+};
+
+static float orient(const Vec2& a, const Vec2& b, const Vec2& c) { // > 0: a, b, c turn counter clockwise
+	return (b.x() - a.x()) * (c.y() - a.y()) - (b.y() - a.y()) * (c.x() - a.x());
+}
+
+// Triangulate a polygon of n corners with positions p (one polygon, simple, roughly planar) and
+// append the triangles, as base + corner, in the polygon's winding. A convex polygon is a fan around
+// corner 0, O(n). A concave one is ear clipped on a linked list of the corners, testing a candidate ear
+// only against the reflex corners in the grid cells it overlaps: about O(n) for evenly spread corners,
+// O(n * r) at worst for r reflex corners. Once no reflex corner is left the rest is a fan; where no ear
+// is found (collinear, self intersecting or degenerate input) a straight or convex corner is clipped anyway
+static void triangulatePolygon(const Vec3* const* p, int n, uint32_t base, vector<uint32_t>& indices, PolygonScratch& scratch) {
+	// plane from Newell's normal, dropping its largest axis, the two kept ones ordered so the
+	// projection keeps the winding the normal points out of
+	Vec3 normal(0, 0, 0);
+	for (int i = 0; i < n; i++) {
+		const Vec3& a = *p[i];
+		const Vec3& b = *p[(i + 1) % n];
+		normal += Vec3((a.y() - b.y()) * (a.z() + b.z()), (a.z() - b.z()) * (a.x() + b.x()), (a.x() - b.x()) * (a.y() + b.y()));
+	}
+	int axis = 2;
+	if (abs(normal.x()) > abs(normal.y()) && abs(normal.x()) > abs(normal.z()))
+		axis = 0;
+	else if (abs(normal.y()) > abs(normal.z()))
+		axis = 1;
+	int u_axis = (axis + 1) % 3, v_axis = (axis + 2) % 3;
+	float flip = normal[axis] < 0 ? -1.0f : 1.0f;
+
+	vector<Vec2>& points = scratch.points;
+	points.resize(n);
+	float extent = 0;
+	for (int i = 0; i < n; i++) {
+		points[i] = Vec2((*p[i])[u_axis] * flip, (*p[i])[v_axis]);
+		extent = max(extent, points[i].cwiseAbs().maxCoeff());
+	}
+	// distance below which a point counts as on a line, the rounding of float coordinates of that size;
+	// a corner is convex if it is farther than that from the line through its neighbours
+	float tolerance = extent * 1e-6f;
+	auto turn = [&](int a, int b, int c) { // > 0: convex, 0: straight, < 0: reflex
+		float o = orient(points[a], points[b], points[c]);
+		float limit = tolerance * (points[c] - points[a]).norm();
+		return o > limit ? 1 : o < -limit ? -1 : 0;
+	};
+
+	vector<char>& reflex = scratch.reflex;
+	vector<int>& reflex_list = scratch.reflex_list;
+	reflex.assign(n, 0);
+	reflex_list.clear();
+	for (int i = 0; i < n; i++)
+		if (turn((i + n - 1) % n, i, (i + 1) % n) <= 0) {
+			reflex[i] = 1;
+			reflex_list.push_back(i);
+		}
+
+	if (reflex_list.empty() || normal == Vec3(0, 0, 0)) { // convex, or all corners on a line
+		for (int i = 1; i + 1 < n; i++) {
+			indices.push_back(base);
+			indices.push_back(base + i);
+			indices.push_back(base + i + 1);
+		}
+		return;
+	}
+
+	vector<int>& prev = scratch.prev;
+	vector<int>& next = scratch.next;
+	prev.resize(n);
+	next.resize(n);
+	for (int i = 0; i < n; i++) {
+		prev[i] = (i + n - 1) % n;
+		next[i] = (i + 1) % n;
+	}
+
+	// about one reflex corner per cell; corners that turn convex stay in their cell and are skipped
+	Vec2 grid_min = points[reflex_list[0]], grid_max = grid_min;
+	for (int r : reflex_list) {
+		grid_min = grid_min.cwiseMin(points[r]);
+		grid_max = grid_max.cwiseMax(points[r]);
+	}
+	int grid_size = max(1, (int)sqrt((float)reflex_list.size()));
+	Vec2 cell_scale = Vec2(grid_size, grid_size).cwiseQuotient((grid_max - grid_min).cwiseMax(Vec2(tolerance, tolerance)));
+	auto cellOf = [&](float x, float y) { // clamped to the grid, the ear's box may reach out of it
+		int cx = clamp((int)((x - grid_min.x()) * cell_scale.x()), 0, grid_size - 1);
+		int cy = clamp((int)((y - grid_min.y()) * cell_scale.y()), 0, grid_size - 1);
+		return Eigen::Vector2i(cx, cy);
+	};
+	vector<int>& cell_start = scratch.cell_start;
+	vector<int>& cell_items = scratch.cell_items;
+	cell_start.assign(grid_size * grid_size + 1, 0);
+	for (int r : reflex_list) {
+		Eigen::Vector2i cell = cellOf(points[r].x(), points[r].y());
+		cell_start[cell.y() * grid_size + cell.x()]++;
+	}
+	for (int c = 0; c < grid_size * grid_size; c++)
+		cell_start[c + 1] += cell_start[c];
+	cell_items.resize(reflex_list.size());
+	for (int r : reflex_list) { // cell_start[c] is the end of cell c, filling back to front moves it to its start
+		Eigen::Vector2i cell = cellOf(points[r].x(), points[r].y());
+		cell_items[--cell_start[cell.y() * grid_size + cell.x()]] = r;
+	}
+
+	auto isEar = [&](int i) {
+		if (reflex[i])
+			return false;
+		const Vec2& a = points[prev[i]];
+		const Vec2& b = points[i];
+		const Vec2& c = points[next[i]];
+		float ab = -tolerance * (b - a).norm(), bc = -tolerance * (c - b).norm(), ca = -tolerance * (a - c).norm();
+		Vec2 lo = a.cwiseMin(b).cwiseMin(c), hi = a.cwiseMax(b).cwiseMax(c);
+		Eigen::Vector2i cell_lo = cellOf(lo.x() - tolerance, lo.y() - tolerance), cell_hi = cellOf(hi.x() + tolerance, hi.y() + tolerance);
+		for (int cy = cell_lo.y(); cy <= cell_hi.y(); cy++)
+			for (int cx = cell_lo.x(); cx <= cell_hi.x(); cx++)
+				for (int k = cell_start[cy * grid_size + cx]; k < cell_start[cy * grid_size + cx + 1]; k++) {
+					int r = cell_items[k];
+					if (reflex[r] && r != prev[i] && r != next[i] && // inside or on the edges of the ear
+						orient(a, b, points[r]) >= ab && orient(b, c, points[r]) >= bc && orient(c, a, points[r]) >= ca)
+						return false;
+				}
+		return true;
+	};
+	int reflex_count = (int)reflex_list.size();
+	auto updateReflex = [&](int i) { // clipping a neighbour of a simple polygon's corner only makes it more convex
+		if (reflex[i] && turn(prev[i], i, next[i]) > 0) {
+			reflex[i] = 0;
+			reflex_count--;
+		}
+	};
+
+	int remaining = n;
+	auto fallbackCorner = [&](int i) { // a loop without an ear: a corner on a line with its neighbours, else a convex one
+		int convex = -1;
+		for (int k = 0; k < remaining; k++, i = next[i]) {
+			int t = turn(prev[i], i, next[i]);
+			if (t == 0)
+				return i;
+			if (t > 0 && convex < 0)
+				convex = i;
+		}
+		return convex >= 0 ? convex : i;
+	};
+
+	int i = 0;
+	int misses = 0; // corners visited since the last ear
+	while (remaining > 3 && reflex_count > 0) {
+		bool ear = isEar(i);
+		if (!ear && misses >= remaining) {
+			i = fallbackCorner(i);
+			ear = true;
+		}
+		if (ear) {
+			indices.push_back(base + prev[i]);
+			indices.push_back(base + i);
+			indices.push_back(base + next[i]);
+			if (reflex[i]) { // a fallback corner
+				reflex[i] = 0;
+				reflex_count--;
+			}
+			next[prev[i]] = next[i];
+			prev[next[i]] = prev[i];
+			updateReflex(prev[i]);
+			updateReflex(next[i]);
+			remaining--;
+			misses = 0;
+			i = next[next[i]]; // moving on instead of back to the neighbours keeps the ears small
+		}
+		else {
+			i = next[i];
+			misses++;
+		}
+	}
+	for (int k = next[i]; next[k] != i; k = next[k]) { // the corners left form a convex polygon, a fan
+		indices.push_back(base + i);
+		indices.push_back(base + k);
+		indices.push_back(base + next[k]);
+	}
+}
+
+static bool distinctCorners(const vector<Vec3>& positions, const vector<Corner>& corners) {
+	for (size_t i = 0; i < corners.size(); i++)
+		for (size_t j = i + 1; j < corners.size(); j++)
+			if (positions[corners[i].position] == positions[corners[j].position])
+				return false;
+	return true;
+}
+
+// read the records of the chunk's lines into its arrays, sized by a counting pass; false if one is malformed
+static bool parseChunk(OBJChunk& chunk) {
+	RecordCounts counts = countRecords(chunk.begin, chunk.end);
+	chunk.positions.reserve(counts.positions);
+	chunk.normals.reserve(counts.normals);
+	chunk.text_coords.reserve(counts.text_coords);
+	chunk.corners.reserve(counts.corners);
+	chunk.face_sizes.reserve(counts.faces);
+
+	const char* p = chunk.begin;
+	while (p < chunk.end) {
+		const char* next;
+		const char* line_end = lineEnd(p, chunk.end, next);
+		const char* token = skipBlanks(p, line_end);
+		const char* token_end = skipToken(token, line_end);
+
+		if (isKeyword(token, token_end, "v")) {
+			const char* q = token_end;
+			Vec3 pos;
+			if (!parseFloat(q, line_end, pos.x()) || !parseFloat(q, line_end, pos.y()) || !parseFloat(q, line_end, pos.z()))
+				return false;
+			chunk.positions.push_back(pos);
+		}
+		else if (isKeyword(token, token_end, "vt")) {
+			const char* q = token_end;
+			Vec2 text_coord;
+			if (!parseFloat(q, line_end, text_coord.x()) || !parseFloat(q, line_end, text_coord.y()))
+				return false;
+			chunk.text_coords.push_back(text_coord);
+		}
+		else if (isKeyword(token, token_end, "vn")) {
+			const char* q = token_end;
+			Vec3 normal;
+			if (!parseFloat(q, line_end, normal.x()) || !parseFloat(q, line_end, normal.y()) || !parseFloat(q, line_end, normal.z()))
+				return false;
+			chunk.normals.push_back(normal);
+		}
+		else if (isKeyword(token, token_end, "f")) {
+			// corners v, v/vt, v//vn or v/vt/vn
+			size_t first = chunk.corners.size();
+			for (const char* q = skipBlanks(token_end, line_end); q < line_end; q = skipBlanks(q, line_end)) {
+				Corner corner{ NO_INDEX, NO_INDEX, NO_INDEX, 0 };
+				if (!parseIndex(q, line_end, chunk.positions.size(), corner.position, corner.relative, RELATIVE_POSITION))
+					return false;
+				if (q < line_end && *q == '/') {
+					q++;
+					if (q < line_end && *q != '/' &&
+						!parseIndex(q, line_end, chunk.text_coords.size(), corner.text_coord, corner.relative, RELATIVE_TEXT_COORD))
+						return false;
+					if (q < line_end && *q == '/') {
+						q++;
+						if (!parseIndex(q, line_end, chunk.normals.size(), corner.normal, corner.relative, RELATIVE_NORMAL))
+							return false;
+					}
+				}
+				if (q < line_end && !isBlank(*q))
+					return false;
+				chunk.corners.push_back(corner);
+			}
+			if (chunk.corners.size() - first < 3)
+				chunk.corners.resize(first);
+			else
+				chunk.face_sizes.push_back((uint32_t)(chunk.corners.size() - first));
+		}
+		else if (isKeyword(token, token_end, "o") || isKeyword(token, token_end, "g") || (p < line_end && *p == 'g')) {
+			GroupRecord::Kind kind = token_end - token == 1 ? GroupRecord::Kind::Group : GroupRecord::Kind::UnnamedGroup;
+			chunk.groups.push_back(GroupRecord{ kind, tail(token_end, line_end), chunk.face_sizes.size(), 0 });
+		}
+		else if (isKeyword(token, token_end, "usemtl"))
+			chunk.groups.push_back(GroupRecord{ GroupRecord::Kind::Material, tail(token_end, line_end), chunk.face_sizes.size(), 0 });
+		p = next;
+	}
+	return true;
+}
+
+// resolve the corners of the chunk's faces against the attributes of the whole file, write its vertices
+// into the mesh arrays from vertex_offset on and triangulate its faces into chunk.indices;
+// false if an index is out of range
+static bool emitChunk(OBJChunk& chunk, const vector<Vec3>& positions, const vector<Vec2>& text_coords,
+	const vector<Vec3>& normals, Mesh& mesh) {
+	vector<Corner> corners; // scratch buffers of one face, reused
+	vector<const Vec3*> polygon;
+	PolygonScratch scratch;
+	size_t triangle_count = 0;
+	for (uint32_t face_size : chunk.face_sizes)
+		triangle_count += face_size - 2;
+	chunk.indices.reserve(triangle_count * 3);
+
+	const Corner* corner = chunk.corners.data();
+	uint32_t base = (uint32_t)chunk.vertex_offset;
+	size_t group = 0;
+	for (size_t face = 0; face < chunk.face_sizes.size(); face++) {
+		for (; group < chunk.groups.size() && chunk.groups[group].face == face; group++)
+			chunk.groups[group].index = (uint32_t)chunk.indices.size();
+
+		corners.clear();
+		bool face_normal = false; // a corner has no normal, objl gives the whole face the cross product normal
+		for (uint32_t k = 0; k < chunk.face_sizes[face]; k++) {
+			Corner c = *corner++;
+			if (c.relative & RELATIVE_POSITION)
+				c.position += (int)chunk.position_offset;
+			if (c.relative & RELATIVE_TEXT_COORD)
+				c.text_coord += (int)chunk.text_coord_offset;
+			if (c.relative & RELATIVE_NORMAL)
+				c.normal += (int)chunk.normal_offset;
+			if (c.position < 0 || (size_t)c.position >= positions.size() ||
+				(c.text_coord != NO_INDEX && (c.text_coord < 0 || (size_t)c.text_coord >= text_coords.size())) ||
+				(c.normal != NO_INDEX && (c.normal < 0 || (size_t)c.normal >= normals.size())))
+				return false;
+			face_normal |= c.normal == NO_INDEX;
+			corners.push_back(c);
+		}
+
+		Vec3 normal(0, 0, 0);
+		if (face_normal) { // (v0 - v1) x (v2 - v1), not normalized, computed as objl's CrossV3 does
+			const Vec3& p0 = positions[corners[0].position];
+			const Vec3& p1 = positions[corners[1].position];
+			const Vec3& p2 = positions[corners[2].position];
+			float ax = p0.x() - p1.x(), ay = p0.y() - p1.y(), az = p0.z() - p1.z();
+			float bx = p2.x() - p1.x(), by = p2.y() - p1.y(), bz = p2.z() - p1.z();
+			normal = Vec3(ay * bz - az * by, az * bx - ax * bz, ax * by - ay * bx);
+		}
+
+		for (size_t k = 0; k < corners.size(); k++) {
+			const Corner& c = corners[k];
+			const Vec3& pos = positions[c.position];
+			const Vec3& n = face_normal ? normal : normals[c.normal];
+			Vec2 text_coord = c.text_coord != NO_INDEX ? text_coords[c.text_coord] : Vec2(0, 0);
+			size_t i = base + k;
+			mesh.pos_x[i] = pos.x(); mesh.pos_y[i] = pos.y(); mesh.pos_z[i] = pos.z();
+			mesh.normal_x[i] = n.x(); mesh.normal_y[i] = n.y(); mesh.normal_z[i] = n.z();
+			mesh.u[i] = text_coord.x(); mesh.v[i] = text_coord.y();
+		}
+
+		if (corners.size() == 3) {
+			chunk.indices.push_back(base);
+			chunk.indices.push_back(base + 1);
+			chunk.indices.push_back(base + 2);
+		}
+		else if (corners.size() == 4 && distinctCorners(positions, corners)) {
+			// objl's split at the diagonal 1 - 3, unless corner 0 or 2 is reflex and only 0 - 2 lies inside
+			const Vec3& p0 = positions[corners[0].position];
+			const Vec3& p1 = positions[corners[1].position];
+			const Vec3& p2 = positions[corners[2].position];
+			const Vec3& p3 = positions[corners[3].position];
+			Vec3 quad_normal = (p2 - p0).cross(p3 - p1);
+			bool reflex_02 = (p0 - p3).cross(p1 - p0).dot(quad_normal) < 0 || (p2 - p1).cross(p3 - p2).dot(quad_normal) < 0;
+			const uint32_t quad[2][6] = { { 0, 1, 3, 1, 2, 3 }, { 0, 1, 2, 0, 2, 3 } };
+			for (uint32_t i : quad[reflex_02])
+				chunk.indices.push_back(base + i);
+		}
+		else {
+			polygon.clear();
+			for (const Corner& c : corners)
+				polygon.push_back(&positions[c.position]);
+			triangulatePolygon(polygon.data(), (int)polygon.size(), base, chunk.indices, scratch);
+		}
+		base += (uint32_t)corners.size();
+	}
+	for (; group < chunk.groups.size(); group++)
+		chunk.groups[group].index = (uint32_t)chunk.indices.size();
+	return true;
+}
+
+bool readOBJ(const string& filename, Mesh& mesh, int thread_count) {
+	MappedFile file;
+	if (!file.open(filename))
+		return false;
+	const char* begin = file.data();
+	const char* end = begin + file.size();
+	ThreadPool pool(thread_count);
+
+	// a few chunks per thread so uneven ones balance, each ends after a line break
+	size_t chunk_count = pool.size() == 1 ? 1 : min((size_t)pool.size() * 4, max<size_t>(1, file.size() / MIN_CHUNK_BYTES));
+	vector<OBJChunk> chunks(chunk_count);
+	const char* chunk_begin = begin;
+	for (size_t i = 0; i < chunk_count; i++) {
+		OBJChunk& chunk = chunks[i];
+		chunk.begin = chunk_begin;
+		chunk.end = end;
+		const char* target = max(begin + file.size() * (i + 1) / chunk_count, chunk_begin);
+		if (i + 1 < chunk_count && target < end) {
+			const char* newline = (const char*)memchr(target, '\n', end - target);
+			chunk.end = newline ? newline + 1 : end;
+		}
+		chunk_begin = chunk.end;
+	}
+
+	pool.parallelFor((int)chunk_count, [&chunks](int i) {
+		chunks[i].valid = parseChunk(chunks[i]);
+	});
+
+	// merge the attributes, every chunk's indices are offset by the elements of the chunks before it
+	vector<Vec3> positions, normals;
+	vector<Vec2> text_coords;
+	size_t vertex_count = 0;
+	for (OBJChunk& chunk : chunks) {
+		if (!chunk.valid)
+			return false;
+		chunk.position_offset = positions.size();
+		chunk.text_coord_offset = text_coords.size();
+		chunk.normal_offset = normals.size();
+		chunk.vertex_offset = vertex_count;
+		positions.insert(positions.end(), chunk.positions.begin(), chunk.positions.end());
+		text_coords.insert(text_coords.end(), chunk.text_coords.begin(), chunk.text_coords.end());
+		normals.insert(normals.end(), chunk.normals.begin(), chunk.normals.end());
+		vertex_count += chunk.corners.size();
+	}
+
+	mesh = Mesh();
+	mesh.pos_x.resize(vertex_count); mesh.pos_y.resize(vertex_count); mesh.pos_z.resize(vertex_count);
+	mesh.normal_x.resize(vertex_count); mesh.normal_y.resize(vertex_count); mesh.normal_z.resize(vertex_count);
+	mesh.u.resize(vertex_count); mesh.v.resize(vertex_count);
+	pool.parallelFor((int)chunk_count, [&](int i) {
+		chunks[i].valid = emitChunk(chunks[i], positions, text_coords, normals, mesh);
+	});
+
+	// join the triangles and replay the group and material lines in file order; objl::Loader's rules:
+	// a group or material line closes the open submesh if it has faces, the i-th usemtl names the i-th submesh
+	bool listening = false; // a group was named
+	string group_name;
+	uint32_t first_index = 0; // of the open submesh
+	vector<string> material_names;
+	auto closeSubMesh = [&](const string& name, uint32_t end_index) {
+		mesh.submeshes.push_back(Mesh::SubMesh{ name, "", first_index, end_index - first_index, Vec3(0, 0, 0), Vec3(0, 0, 0) });
+		first_index = end_index;
+	};
+	for (const OBJChunk& chunk : chunks) {
+		if (!chunk.valid)
+			return false;
+		uint32_t index_offset = (uint32_t)mesh.indices.size();
+		mesh.indices.insert(mesh.indices.end(), chunk.indices.begin(), chunk.indices.end());
+		for (const GroupRecord& record : chunk.groups) {
+			uint32_t index = index_offset + record.index;
+			if (record.kind == GroupRecord::Kind::Material) {
+				material_names.push_back(record.name);
+				if (index > first_index) // the material changes within a group
+					closeSubMesh(group_name + "_2", index);
+			}
+			else if (!listening) {
+				listening = true;
+				group_name = record.kind == GroupRecord::Kind::Group ? record.name : "unnamed";
+			}
+			else if (index > first_index) {
+				closeSubMesh(group_name, index);
+				group_name = record.name;
+			}
+			else
+				group_name = record.kind == GroupRecord::Kind::Group ? record.name : "unnamed";
+		}
+	}
+
+	if (mesh.indices.size() > first_index)
+		closeSubMesh(group_name, (uint32_t)mesh.indices.size());
+	for (size_t i = 0; i < material_names.size() && i < mesh.submeshes.size(); i++)
+		mesh.submeshes[i].material = material_names[i];
+	mesh.computeBounds();
+	return mesh.vertexCount() > 0;
+}
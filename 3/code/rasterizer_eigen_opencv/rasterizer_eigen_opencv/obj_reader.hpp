@@ -0,0 +1,21 @@
+#ifndef RASTERIZER_OBJ_READER_H
+#define RASTERIZER_OBJ_READER_H
+
+#include "mesh.hpp"
+#include <string>
+
+using namespace std;
+
+// Read an OBJ file into mesh. The file is memory mapped and scanned in place, numbers are converted
+// with from_chars and the records go straight into arrays sized by a first counting pass.
+// thread_count threads (0: one per core) parse chunks of whole lines and triangulate their faces,
+// a merge pass resolves the negative indices and the groups across chunks; the mesh does not depend on the thread count.
+// The result is the mesh Mesh(objl::Loader) builds after LoadFile: one vertex per face corner,
+// triangles and convex quads split the same way, faces without normals get the same face normal and one
+// submesh per group / material run. Larger polygons are ear clipped in about linear time rather than
+// objl's cubic search, so their triangles differ; concave quads are split at the diagonal inside them.
+// Submesh materials are the usemtl names, the .mtl file is not read.
+// Returns false if the file cannot be read, a record is malformed or there are no faces.
+bool readOBJ(const string& filename, Mesh& mesh, int thread_count = 0);
+
+#endif
@@ -0,0 +1,197 @@
+#include "raster_kernel.hpp"
+#include <algorithm>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define RASTER_KERNEL_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// GCC and Clang only emit SIMD instructions in functions compiled for that instruction set,
+// MSVC accepts the intrinsics anywhere
+#if defined(__GNUC__) || defined(__clang__)
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_SSE2
+#define TARGET_AVX2
+#endif
+
+// GCC fuses multiplies and adds into FMAs by default (intrinsics included) when the target has them,
+// the kernels only round identically without that
+#if defined(__GNUC__) && !defined(__clang__)
+#define NO_FP_CONTRACT __attribute__((optimize("fp-contract=off")))
+#else
+#define NO_FP_CONTRACT
+#endif
+
+NO_FP_CONTRACT static unsigned rasterSpanScalar(const RasterSpan& span, const float* depth, int count, float* z_out) {
+#ifdef __clang__
+#pragma clang fp contract(off)
+#endif
+	unsigned mask = 0;
+	int64_t w0 = span.w[0], w1 = span.w[1], w2 = span.w[2];
+	for (int i = 0; i < count; i++, w0 += span.step_x[0], w1 += span.step_x[1], w2 += span.step_x[2]) {
+		if ((w0 | w1 | w2) < 0) // outside if any edge value is negative
+			continue;
+
+		float alpha = (float)w0 * span.inv_area;
+		float beta = (float)w1 * span.inv_area;
+		float gamma = (float)w2 * span.inv_area;
+		float z = alpha * span.z[0] + beta * span.z[1] + gamma * span.z[2];
+		if (z < depth[i]) {
+			z_out[i] = z;
+			mask |= 1u << i;
+		}
+	}
+	return mask;
+}
+
+#ifdef RASTER_KERNEL_X86
+
+TARGET_SSE2 NO_FP_CONTRACT static unsigned rasterSpanSSE2(const RasterSpan& span, const float* depth, int count, float* z_out) {
+	float depth_tmp[SPAN_WIDTH] = {};
+	if (count < SPAN_WIDTH) { // never read past the end of the span
+		copy(depth, depth + count, depth_tmp);
+		depth = depth_tmp;
+	}
+
+	const __m128 inv_area = _mm_set1_ps(span.inv_area);
+	const __m128 z0 = _mm_set1_ps(span.z[0]), z1 = _mm_set1_ps(span.z[1]), z2 = _mm_set1_ps(span.z[2]);
+	const __m128i minus_one = _mm_set1_epi32(-1);
+
+	// base value plus per-lane step; SSE2 has no 32-bit multiply, so the four lane offsets are set up once
+	// and the second half only adds 4 steps, wrapping like the scalar adds for lanes past the end of the span
+	__m128i w[3], step4[3];
+	for (int e = 0; e < 3; e++) {
+		uint32_t step = (uint32_t)span.step_x[e];
+		w[e] = _mm_add_epi32(_mm_set1_epi32((int32_t)span.w[e]), _mm_setr_epi32(0, (int32_t)step, (int32_t)(2 * step), (int32_t)(3 * step)));
+		step4[e] = _mm_set1_epi32((int32_t)(4 * step));
+	}
+
+	unsigned mask = 0;
+	for (int half = 0; half < 2; half++) {
+		int k = half * 4;
+		if (half > 0)
+			for (int e = 0; e < 3; e++)
+				w[e] = _mm_add_epi32(w[e], step4[e]);
+
+		__m128i inside = _mm_cmpgt_epi32(_mm_or_si128(_mm_or_si128(w[0], w[1]), w[2]), minus_one);
+
+		__m128 alpha = _mm_mul_ps(_mm_cvtepi32_ps(w[0]), inv_area);
+		__m128 beta = _mm_mul_ps(_mm_cvtepi32_ps(w[1]), inv_area);
+		__m128 gamma = _mm_mul_ps(_mm_cvtepi32_ps(w[2]), inv_area);
+		__m128 z = _mm_add_ps(_mm_add_ps(_mm_mul_ps(alpha, z0), _mm_mul_ps(beta, z1)), _mm_mul_ps(gamma, z2));
+
+		__m128 pass = _mm_and_ps(_mm_castsi128_ps(inside), _mm_cmplt_ps(z, _mm_loadu_ps(depth + k)));
+		_mm_storeu_ps(z_out + k, z);
+		mask |= (unsigned)_mm_movemask_ps(pass) << k;
+	}
+	return mask & ((1u << count) - 1);
+}
+
+TARGET_AVX2 NO_FP_CONTRACT static unsigned rasterSpanAVX2(const RasterSpan& span, const float* depth, int count, float* z_out) {
+	float depth_tmp[SPAN_WIDTH] = {};
+	if (count < SPAN_WIDTH) {
+		copy(depth, depth + count, depth_tmp);
+		depth = depth_tmp;
+	}
+
+	const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	__m256i w[3];
+	for (int e = 0; e < 3; e++)
+		w[e] = _mm256_add_epi32(_mm256_set1_epi32((int32_t)span.w[e]),
+			_mm256_mullo_epi32(_mm256_set1_epi32((int32_t)span.step_x[e]), lane));
+
+	__m256i inside = _mm256_cmpgt_epi32(_mm256_or_si256(_mm256_or_si256(w[0], w[1]), w[2]), _mm256_set1_epi32(-1));
+
+	const __m256 inv_area = _mm256_set1_ps(span.inv_area);
+	__m256 alpha = _mm256_mul_ps(_mm256_cvtepi32_ps(w[0]), inv_area);
+	__m256 beta = _mm256_mul_ps(_mm256_cvtepi32_ps(w[1]), inv_area);
+	__m256 gamma = _mm256_mul_ps(_mm256_cvtepi32_ps(w[2]), inv_area);
+	// separate multiplies and adds (no FMA) to round exactly like the scalar kernel
+	__m256 z = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(alpha, _mm256_set1_ps(span.z[0])),
+		_mm256_mul_ps(beta, _mm256_set1_ps(span.z[1]))), _mm256_mul_ps(gamma, _mm256_set1_ps(span.z[2])));
+
+	__m256 pass = _mm256_and_ps(_mm256_castsi256_ps(inside), _mm256_cmp_ps(z, _mm256_loadu_ps(depth), _CMP_LT_OQ));
+	_mm256_storeu_ps(z_out, z);
+	return (unsigned)_mm256_movemask_ps(pass) & ((1u << count) - 1);
+}
+
+static bool cpuHasAVX2() {
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7)
+		return false;
+	__cpuid(info, 1);
+	bool os_saves_ymm = (info[2] & (1 << 27)) && (_xgetbv(0) & 6) == 6; // OSXSAVE, XMM and YMM state enabled
+	__cpuidex(info, 7, 0);
+	return os_saves_ymm && (info[1] & (1 << 5));
+#else
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+
+static bool cpuHasSSE2() {
+#if defined(_M_X64) || defined(__x86_64__)
+	return true; // part of x86-64
+#elif defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 1);
+	return (info[3] & (1 << 26)) != 0;
+#else
+	return __builtin_cpu_supports("sse2");
+#endif
+}
+
+#endif
+
+RasterSpanFunction rasterSpanFunction(RasterKernel kernel) {
+#ifdef RASTER_KERNEL_X86
+	switch (kernel) {
+	case RasterKernel::SSE2:
+		return rasterSpanSSE2;
+	case RasterKernel::AVX2:
+		return rasterSpanAVX2;
+	default:
+		break;
+	}
+#endif
+	return rasterSpanScalar;
+}
+
+bool rasterKernelSupported(RasterKernel kernel) {
+	switch (kernel) {
+	case RasterKernel::Scalar:
+		return true;
+#ifdef RASTER_KERNEL_X86
+	case RasterKernel::SSE2:
+		return cpuHasSSE2();
+	case RasterKernel::AVX2:
+		return cpuHasAVX2();
+#endif
+	default:
+		return false;
+	}
+}
+
+RasterKernel bestRasterKernel() {
+	static const RasterKernel best =
+		rasterKernelSupported(RasterKernel::AVX2) ? RasterKernel::AVX2 :
+		rasterKernelSupported(RasterKernel::SSE2) ? RasterKernel::SSE2 : RasterKernel::Scalar;
+	return best;
+}
+
+const char* rasterKernelName(RasterKernel kernel) {
+	switch (kernel) {
+	case RasterKernel::SSE2:
+		return "SSE2";
+	case RasterKernel::AVX2:
+		return "AVX2";
+	default:
+		return "scalar";
+	}
+}
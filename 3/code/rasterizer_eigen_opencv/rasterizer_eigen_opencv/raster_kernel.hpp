@@ -0,0 +1,35 @@
+#ifndef RASTERIZER_RASTER_KERNEL_H
+#define RASTERIZER_RASTER_KERNEL_H
+
+#include <cstdint>
+
+using namespace std;
+
+const int SPAN_WIDTH = 8; // pixels tested by one kernel call
+
+struct RasterSpan { // one row segment of a triangle
+	int64_t w[3];      // edge values at the first pixel
+	int64_t step_x[3]; // edge value increments from one pixel to the next
+	float inv_area;
+	float z[3];        // screen-space depth of the three vertices
+};
+
+enum class RasterKernel {
+	Scalar,
+	SSE2, // 2 x 4 lanes
+	AVX2  // 8 lanes
+};
+
+// Coverage and depth test for `count` (1 to SPAN_WIDTH) horizontally adjacent pixels.
+// Bit i of the result is set if pixel i is covered and its interpolated depth is less than depth[i];
+// that depth is written to z_out[i]. depth is only read for the first `count` pixels.
+// The SIMD kernels work on 32-bit edge values: every pixel of the span must have |w| < 2^31.
+// All kernels return identical masks and depths.
+typedef unsigned (*RasterSpanFunction)(const RasterSpan& span, const float* depth, int count, float* z_out);
+
+RasterSpanFunction rasterSpanFunction(RasterKernel kernel);
+bool rasterKernelSupported(RasterKernel kernel); // checks the running CPU
+RasterKernel bestRasterKernel();
+const char* rasterKernelName(RasterKernel kernel);
+
+#endif
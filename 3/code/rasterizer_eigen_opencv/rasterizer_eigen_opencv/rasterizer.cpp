@@ -4,6 +4,7 @@
 #include <vector>
 #include <limits>
 #include <cmath>
+#include <bit>
 #include <opencv2/opencv.hpp>
 #include <Eigen/Eigen>
 
@@ -15,28 +16,55 @@ using Mat2 = Eigen::Matrix2f;
 using Mat3 = Eigen::Matrix3f;
 using Mat4 = Eigen::Matrix4f;
 
-Rasterizer::Rasterizer(int w, int h) : width(w), height(h), pbr_material(nullptr) {
+Rasterizer::Rasterizer(int w, int h) : width(w), height(h), pbr_material(nullptr), pbr_shader(nullptr), batch_shading(false),
+	light_limit(0), light_culling(true), lights_dirty(true), shading_mode(ShadingMode::Forward), gbuffer_pending(false), fragments_passed(0), fragments_shaded(0), state_dirty(true), draw_stamp(0) {
+	setRasterKernel(bestRasterKernel());
+
 	pixel_buffer = cv::Mat(h, w, CV_8UC3, cv::Scalar(0, 0, 0));
 	depth_buffer.resize(w * h, numeric_limits<float>::infinity());
+
+	tiles_x = (w + TILE_SIZE - 1) / TILE_SIZE;
+	tiles_y = (h + TILE_SIZE - 1) / TILE_SIZE;
+
+	hiz_width = (w + HIZ_BLOCK - 1) / HIZ_BLOCK;
+	hiz_height = (h + HIZ_BLOCK - 1) / HIZ_BLOCK;
+	hiz_max_depth.resize(hiz_width * hiz_height, numeric_limits<float>::infinity());
 }
 
 void Rasterizer::clear() {
+	// pending triangles belong to the old frame
+	raster_triangles.clear();
+	triangle_copies.clear();
+	for (auto& bin : tile_bins)
+		bin.clear();
+	draw_states.clear();
+	state_dirty = true;
+
 	pixel_buffer = cv::Mat(height, width, CV_8UC3, cv::Scalar(0, 0, 0));
 	depth_buffer.clear();
 	depth_buffer.resize(width * height, numeric_limits<float>::infinity());
+	hiz_max_depth.assign(hiz_width * hiz_height, numeric_limits<float>::infinity());
+	if (shading_mode == ShadingMode::Deferred)
+		gbuffer.state.assign(width * height, -1);
+	gbuffer_pending = false;
+	fragments_passed = 0;
+	fragments_shaded = 0;
 }
 
 void Rasterizer::setModel(const Mat4& m) {
 	model = m;
+	state_dirty = true;
 }
 
 void Rasterizer::setView(const Mat4& v) {
 	view = v;
 	view_inv = v.inverse();
+	state_dirty = true;
 }
 
 void Rasterizer::setProjection(const Mat4& p) {
 	projection = p;
+	state_dirty = true;
 }
 
 void Rasterizer::setVertexShader(function<Vec3(const Shader::VertexPayload&)> v_s) {
@@ -45,42 +73,396 @@ void Rasterizer::setVertexShader(function<Vec3(const Shader::VertexPayload&)> v_
 
 void Rasterizer::setFragmentShader(function<Vec3(const Shader::FragmentPayload&, const vector<Shader::Light>&)> f_s) {
 	fragment_shader = f_s;
+	state_dirty = true;
 }
 
 void Rasterizer::setTexture(Texture t) {
+	flush(); // pending triangles reference the current texture
 	texture = t;
+	state_dirty = true;
 }
 
 void Rasterizer::setSkybox(const Skybox& sb) {
+	flush(); // pending triangles may be lit by the current skybox
 	skybox = sb;
+	state_dirty = true;
 }
 
 void Rasterizer::setPBRMaterial(PBRMaterial* material) {
 	pbr_material = material;
+	state_dirty = true;
+}
+
+void Rasterizer::setPBRShader(const Shader* shader) {
+	pbr_shader = shader;
+	state_dirty = true;
+}
+
+void Rasterizer::setBatchShading(bool enabled) {
+	flush();
+	batch_shading = enabled;
+	state_dirty = true;
+}
+
+bool Rasterizer::getBatchShading() const {
+	return batch_shading;
+}
+
+void Rasterizer::setLights(const vector<Shader::Light>& l) {
+	flush(); // pending triangles are lit by the current lights
+	lights = Shader::LightList(l);
+
+	// unbounded lights rank first, ties keep the order of the list
+	light_order.resize(l.size());
+	for (int i = 0; i < (int)l.size(); i++)
+		light_order[i] = i;
+	auto strength = [&l](int i) {
+		return isfinite(l[i].radius) ? l[i].intensity.maxCoeff() * l[i].radius * l[i].radius : numeric_limits<float>::infinity();
+	};
+	stable_sort(light_order.begin(), light_order.end(), [&strength](int a, int b) { return strength(a) > strength(b); });
+
+	lights_dirty = true;
+	state_dirty = true;
+}
+
+const vector<Shader::Light>& Rasterizer::getLights() const {
+	return lights.lights;
+}
+
+void Rasterizer::setLightLimit(int n) {
+	flush();
+	light_limit = max(n, 0);
+	lights_dirty = true;
+	state_dirty = true;
+}
+
+int Rasterizer::getLightLimit() const {
+	return light_limit;
+}
+
+void Rasterizer::setLightCulling(bool enabled) {
+	flush();
+	light_culling = enabled;
+	lights_dirty = true;
+	state_dirty = true;
 }
 
-cv::Mat Rasterizer::getPixels() const {
+bool Rasterizer::getLightCulling() const {
+	return light_culling;
+}
+
+void Rasterizer::setThreadCount(int n) {
+	flush();
+	if (n == 1) {
+		thread_pool.reset();
+		tile_bins.clear();
+	}
+	else {
+		thread_pool = make_unique<ThreadPool>(n);
+		tile_bins.assign(tiles_x * tiles_y, vector<int>());
+	}
+	state_dirty = true;
+}
+
+void Rasterizer::setRasterKernel(RasterKernel kernel) {
+	flush();
+	if (!rasterKernelSupported(kernel))
+		kernel = RasterKernel::Scalar;
+	raster_kernel = kernel;
+	raster_span = rasterSpanFunction(kernel);
+}
+
+RasterKernel Rasterizer::getRasterKernel() const {
+	return raster_kernel;
+}
+
+void Rasterizer::setShadingMode(ShadingMode mode) {
+	flush();
+	shading_mode = mode;
+	if (mode == ShadingMode::Deferred) {
+		gbuffer.pos.resize(width * height);
+		gbuffer.normal.resize(width * height);
+		gbuffer.text_coord.resize(width * height);
+		gbuffer.text_coord_deriv.resize(width * height);
+		gbuffer.color.resize(width * height);
+		gbuffer.state.assign(width * height, -1);
+	}
+	else {
+		gbuffer = GBuffer();
+	}
+	if (mode != ShadingMode::ZPrepass)
+		prepass_depth = vector<float>();
+	state_dirty = true;
+}
+
+Rasterizer::ShadingMode Rasterizer::getShadingMode() const {
+	return shading_mode;
+}
+
+Rasterizer::FrameStats Rasterizer::getFrameStats() {
+	flush();
+	FrameStats stats{ fragments_passed, fragments_shaded, 0 };
+	for (float depth : depth_buffer)
+		if (depth < numeric_limits<float>::infinity())
+			stats.pixels_covered++;
+	return stats;
+}
+
+int Rasterizer::getThreadCount() const {
+	return thread_pool ? thread_pool->size() : 1;
+}
+
+cv::Mat Rasterizer::getPixels() {
+	flush();
 	return pixel_buffer;
 }
 
+void Rasterizer::captureDrawState() {
+	Mat4 view_projection = projection * view;
+	if (lights_dirty || view_projection != tile_lights_view_projection) {
+		flush(); // fragments still waiting are lit with the current tile lights
+		cullLights(view_projection);
+	}
+
+	const Skybox* sb = skybox ? &*skybox : nullptr;
+	Shader::PBRKernel pbr_kernel = pbr_shader ? pbr_shader->pbrKernel(pbr_material, sb) : nullptr;
+	Shader::PBRBatchKernel pbr_batch_kernel = pbr_shader && batch_shading ? pbr_shader->pbrBatchKernel(pbr_material, sb) : nullptr;
+	DrawState state{ model, projection * view * model, (model.inverse()).transpose().block<3, 3>(0, 0),
+		fragment_shader, pbr_kernel, pbr_batch_kernel, pbr_shader, texture ? &*texture : nullptr, pbr_material };
+	if (thread_pool || shading_mode != ShadingMode::Forward)
+		draw_states.push_back(state); // earlier states are still referenced by recorded triangles or the G-buffer
+	else
+		draw_states.assign(1, state);
+	state_dirty = false;
+}
+
+// bin every light into the tiles its sphere of influence can cover on screen
+void Rasterizer::cullLights(const Mat4& view_projection) {
+	// strongest lights first, so a tile at the light limit has kept the ones that matter most
+	vector<vector<int>> bins(tiles_x * tiles_y);
+	for (int index : light_order) {
+		const Shader::Light& light = lights.lights[index];
+		int minx = 0, maxx = width - 1, miny = 0, maxy = height - 1;
+		if (light_culling && isfinite(light.radius)) {
+			// the screen bounds of the corners of the sphere's bounding box hold the projected sphere,
+			// unless a corner is behind the eye; a box completely behind the eye lights nothing visible
+			float x0 = numeric_limits<float>::infinity(), x1 = -x0, y0 = x0, y1 = -x0;
+			int behind = 0;
+			for (int corner = 0; corner < 8; corner++) {
+				Vec4 clip = view_projection * Vec4(light.pos.x() + (corner & 1 ? light.radius : -light.radius),
+					light.pos.y() + (corner & 2 ? light.radius : -light.radius),
+					light.pos.z() + (corner & 4 ? light.radius : -light.radius), 1.0f);
+				if (clip.w() < 1e-6f) {
+					behind++;
+					continue;
+				}
+				float x = (clip.x() / clip.w() + 1.0f) * (float)width * 0.5f;
+				float y = (1.0f - clip.y() / clip.w()) * (float)height * 0.5f;
+				x0 = min(x0, x);
+				x1 = max(x1, x);
+				y0 = min(y0, y);
+				y1 = max(y1, y);
+			}
+			if (behind == 8)
+				continue;
+			if (behind == 0) {
+				if (x1 < 0.0f || x0 >= width || y1 < 0.0f || y0 >= height)
+					continue;
+				minx = max(minx, (int)floor(x0));
+				maxx = min(maxx, (int)ceil(x1));
+				miny = max(miny, (int)floor(y0));
+				maxy = min(maxy, (int)ceil(y1));
+			}
+		}
+		for (int ty = miny / TILE_SIZE; ty <= maxy / TILE_SIZE; ty++) {
+			for (int tx = minx / TILE_SIZE; tx <= maxx / TILE_SIZE; tx++) {
+				vector<int>& bin = bins[ty * tiles_x + tx];
+				if (light_limit == 0 || (int)bin.size() < light_limit)
+					bin.push_back(index);
+			}
+		}
+	}
+
+	// every tile sums its lights in the order of the list, so culling leaves the image unchanged
+	tile_lights.assign(tiles_x * tiles_y, Shader::LightList());
+	for (int tile = 0; tile < tiles_x * tiles_y; tile++) {
+		sort(bins[tile].begin(), bins[tile].end());
+		for (int index : bins[tile])
+			tile_lights[tile].add(lights, index);
+	}
+	tile_lights_view_projection = view_projection;
+	lights_dirty = false;
+}
+
+const Shader::LightList& Rasterizer::tileLights(int x, int y) const {
+	return tile_lights[(y / TILE_SIZE) * tiles_x + x / TILE_SIZE];
+}
+
 void Rasterizer::drawTriangle(const Triangle& t) {
-	Mat4 mvp = projection * view * model;
-	Vec4 vec[] = {
-		mvp * Vec4(t.a().x(), t.a().y(), t.a().z(), 1.0),
-		mvp * Vec4(t.b().x(), t.b().y(), t.b().z(), 1.0),
-		mvp * Vec4(t.c().x(), t.c().y(), t.c().z(), 1.0)
-	};
+	drawTriangles(span<const Triangle>(&t, 1));
+}
+
+void Rasterizer::drawTriangles(span<const Triangle> triangles) {
+	if (state_dirty)
+		captureDrawState();
+	int state = (int)draw_states.size() - 1;
+	const Mat4& mvp = draw_states[state].mvp;
+
+	RasterTriangle rt;
+	rt.mesh = nullptr;
+	for (const Triangle& t : triangles) {
+		rt.state = state;
+		rt.triangle = &t;
+		Vec4 clip[] = {
+			mvp * Vec4(t.a().x(), t.a().y(), t.a().z(), 1.0),
+			mvp * Vec4(t.b().x(), t.b().y(), t.b().z(), 1.0),
+			mvp * Vec4(t.c().x(), t.c().y(), t.c().z(), 1.0)
+		};
+		if (setupTriangle(clip, t.text_coord, rt))
+			submitTriangle(rt);
+	}
+}
+
+void Rasterizer::drawMesh(const Mesh& mesh, uint32_t first_index, uint32_t index_count) {
+	if (state_dirty)
+		captureDrawState();
+	int state = (int)draw_states.size() - 1;
+	const Mat4& mvp = draw_states[state].mvp;
+
+	// a new stamp invalidates the whole cache, the arrays are only cleared when the stamp wraps around
+	if ((int)clip_stamp.size() < mesh.vertexCount()) {
+		clip_cache.resize(mesh.vertexCount());
+		clip_stamp.resize(mesh.vertexCount(), 0);
+	}
+	if (++draw_stamp == 0) {
+		fill(clip_stamp.begin(), clip_stamp.end(), 0);
+		draw_stamp = 1;
+	}
+
+	uint32_t last_index = (uint32_t)min((uint64_t)first_index + index_count, (uint64_t)mesh.indices.size());
+	RasterTriangle rt;
+	rt.mesh = &mesh;
+	rt.triangle = nullptr;
+	for (uint32_t i = first_index; i + 3 <= last_index; i += 3) {
+		Vec4 clip[3];
+		Vec2 text_coord[3];
+		for (int j = 0; j < 3; j++) {
+			uint32_t vertex = mesh.indices[i + j];
+			if (clip_stamp[vertex] != draw_stamp) {
+				clip_cache[vertex] = mvp * Vec4(mesh.pos_x[vertex], mesh.pos_y[vertex], mesh.pos_z[vertex], 1.0f);
+				clip_stamp[vertex] = draw_stamp;
+			}
+			clip[j] = clip_cache[vertex];
+			text_coord[j] = Vec2(mesh.u[vertex], mesh.v[vertex]);
+			rt.vertex[j] = vertex;
+		}
+		rt.state = state;
+		if (setupTriangle(clip, text_coord, rt))
+			submitTriangle(rt);
+	}
+}
+
+// rasterize a set up triangle now, or record it in the draw list for flush()
+void Rasterizer::submitTriangle(const RasterTriangle& rt) {
+	if (shading_mode == ShadingMode::Deferred)
+		gbuffer_pending = true;
+
+	if (!thread_pool && shading_mode != ShadingMode::ZPrepass) {
+		rasterizeTriangle(rt, RasterPass::Shade, 0, 0, width - 1, height - 1);
+		return;
+	}
+
+	// record in the draw list and bin into every tile the bounding box touches, rasterized in flush()
+	int index = (int)raster_triangles.size();
+	raster_triangles.push_back(rt);
+	if (rt.triangle) { // the caller's triangle may be gone by flush()
+		triangle_copies.push_back(*rt.triangle);
+		raster_triangles.back().triangle = &triangle_copies.back();
+	}
+	if (!thread_pool)
+		return;
+	for (int ty = rt.miny / TILE_SIZE; ty <= rt.maxy / TILE_SIZE; ty++)
+		for (int tx = rt.minx / TILE_SIZE; tx <= rt.maxx / TILE_SIZE; tx++)
+			tile_bins[ty * tiles_x + tx].push_back(index);
+}
+
+void Rasterizer::flush() {
+	bool flushed = false;
+
+	if (!raster_triangles.empty()) {
+		if (shading_mode == ShadingMode::ZPrepass) {
+			replayDrawList(RasterPass::DepthOnly);
+			prepass_depth = depth_buffer;
+			replayDrawList(RasterPass::DepthEqual);
+		}
+		else {
+			replayDrawList(RasterPass::Shade);
+		}
+
+		raster_triangles.clear();
+		triangle_copies.clear();
+		for (auto& bin : tile_bins)
+			bin.clear();
+		flushed = true;
+	}
+
+	// deferred mode: shade the visible fragment of every pixel once
+	if (gbuffer_pending) {
+		if (thread_pool) {
+			thread_pool->parallelFor(tiles_x * tiles_y, [this](int tile) {
+				int x0 = (tile % tiles_x) * TILE_SIZE;
+				int y0 = (tile / tiles_x) * TILE_SIZE;
+				shadeGBuffer(x0, y0, min(x0 + TILE_SIZE, width) - 1, min(y0 + TILE_SIZE, height) - 1);
+			});
+		}
+		else {
+			shadeGBuffer(0, 0, width - 1, height - 1);
+		}
+		gbuffer_pending = false;
+		flushed = true;
+	}
+
+	if (flushed) {
+		draw_states.clear();
+		state_dirty = true;
+	}
+}
+
+void Rasterizer::replayDrawList(RasterPass pass) {
+	if (!thread_pool) {
+		for (const RasterTriangle& rt : raster_triangles)
+			rasterizeTriangle(rt, pass, 0, 0, width - 1, height - 1);
+		return;
+	}
+
+	// each tile owns a disjoint block of pixel_buffer and depth_buffer and replays its
+	// triangles in submission order, so no locking is needed and the result matches immediate mode
+	thread_pool->parallelFor(tiles_x * tiles_y, [this, pass](int tile) {
+		int x0 = (tile % tiles_x) * TILE_SIZE;
+		int y0 = (tile / tiles_x) * TILE_SIZE;
+		int x1 = min(x0 + TILE_SIZE, width) - 1;
+		int y1 = min(y0 + TILE_SIZE, height) - 1;
+		for (int index : tile_bins[tile])
+			rasterizeTriangle(raster_triangles[index], pass, x0, y0, x1, y1);
+	});
+}
+
+// clip: the vertices transformed by the draw state's MVP, text_coord: their texture coordinates
+bool Rasterizer::setupTriangle(const Vec4 clip[3], const Vec2 text_coord[3], RasterTriangle& rt) const {
+	Vec4 vec[] = { clip[0], clip[1], clip[2] };
 
 	// Check if any vertex is behind camera or has invalid w before perspective division
 	// If any vertex is behind camera (w <= 0), skip this triangle
 	for (int i = 0; i < 3; i++) {
 		if (vec[i].w() <= 0.0f || std::abs(vec[i].w()) < 1e-6f) {
-			return;
+			return false;
 		}
 	}
 
-	for (auto& v : vec)
-		v /= v.w();
+	for (int i = 0; i < 3; i++) {
+		rt.inv_w[i] = 1.0f / vec[i].w();
+		vec[i] /= vec[i].w();
+	}
 
 	// Convert to screen space
 	Vec3 vec_screen[] = {
@@ -96,7 +478,7 @@ void Rasterizer::drawTriangle(const Triangle& t) {
 	// Check if triangle bounding box is completely outside screen bounds [0, width) x [0, height)
 	// Only skip if the entire triangle is outside
 	if (maxx < 0 || minx >= width || maxy < 0 || miny >= height) {
-		return;
+		return false;
 	}
 
 	// Clamp to screen bounds for safe array access
@@ -107,132 +489,369 @@ void Rasterizer::drawTriangle(const Triangle& t) {
 
 	// Skip if triangle is completely outside screen after clamping (shouldn't happen, but be safe)
 	if (minx > maxx || miny > maxy) {
-		return;
+		return false;
+	}
+
+	if (!edgeFunctions(vec_screen[0].head<2>(), vec_screen[1].head<2>(), vec_screen[2].head<2>(), rt.edges)) {
+		return false;
+	}
+
+	for (int i = 0; i < 3; i++)
+		rt.screen[i] = vec_screen[i];
+	rt.minx = minx;
+	rt.maxx = maxx;
+	rt.miny = miny;
+	rt.maxy = maxy;
+
+	// texture coordinates are interpolated linearly in screen space, so their differences across a 2x2 pixel
+	// quad are the same everywhere in the triangle: a pixel step in x (y) changes weight i by a[i] (b[i]) subpixels
+	rt.text_coord_dx = Vec2(0, 0);
+	rt.text_coord_dy = Vec2(0, 0);
+	for (int i = 0; i < 3; i++) {
+		rt.text_coord_dx += text_coord[i] * ((float)(rt.edges.a[i] * SUBPIXEL_ONE) * rt.edges.inv_area);
+		rt.text_coord_dy += text_coord[i] * ((float)(rt.edges.b[i] * SUBPIXEL_ONE) * rt.edges.inv_area);
 	}
 
-	// Use lights (default lights if fragment_shader is set)
-	auto l1 = Shader::Light{ {-20, 20, -20}, {500, 500, 500} };
-	auto l2 = Shader::Light{ {-20, 20, 0}, {500, 500, 500} };
-	vector<Shader::Light> lights = { l1, l2 };
+	// lower bound of the interpolated depth, so a block is only rejected when no pixel could pass the
+	// depth test: the top-left bias makes the barycentrics sum to as little as 1 - 3 * inv_area, and
+	// float rounding costs a few more ulps of the largest depth
+	float z_min = min({ vec_screen[0].z(), vec_screen[1].z(), vec_screen[2].z() });
+	float z_abs = max({ fabs(vec_screen[0].z()), fabs(vec_screen[1].z()), fabs(vec_screen[2].z()) });
+	float weight_sum_min = max(0.0f, 1.0f - 3.0f * rt.edges.inv_area);
+	rt.z_reject = min(z_min, z_min * weight_sum_min) - z_abs * 1e-5f;
 
-	// run rasterizer
-	for (int y = miny; y <= maxy; y++) {
-		for (int x = minx; x <= maxx; x++) {
-			// Additional bounds check before accessing arrays
-			if (x < 0 || x >= width || y < 0 || y >= height) {
+	// edge functions are affine, so their extremes over the bounding box are at its corners
+	rt.fits_int32 = true;
+	for (int i = 0; i < 3; i++) {
+		for (int corner = 0; corner < 4; corner++) {
+			int64_t px = (int64_t)(corner & 1 ? maxx : minx) * SUBPIXEL_ONE + SUBPIXEL_ONE / 2;
+			int64_t py = (int64_t)(corner & 2 ? maxy : miny) * SUBPIXEL_ONE + SUBPIXEL_ONE / 2;
+			int64_t w = rt.edges.a[i] * px + rt.edges.b[i] * py + rt.edges.c[i];
+			if (w < INT32_MIN || w > INT32_MAX)
+				rt.fits_int32 = false;
+		}
+	}
+	return true;
+}
+
+// Scan-convert the part of the triangle's bounding box that lies inside [x0, x1] x [y0, y1]
+void Rasterizer::rasterizeTriangle(const RasterTriangle& rt, RasterPass pass, int x0, int y0, int x1, int y1) {
+	const DrawState& state = draw_states[rt.state];
+	int minx = max(rt.minx, x0);
+	int maxx = min(rt.maxx, x1);
+	int miny = max(rt.miny, y0);
+	int maxy = min(rt.maxy, y1);
+
+	// the SIMD kernels need every edge value of the triangle to fit in 32 bits
+	RasterSpanFunction test_span = rt.fits_int32 ? raster_span : rasterSpanFunction(RasterKernel::Scalar);
+
+	const EdgeFunctions& e = rt.edges;
+	RasterSpan span;
+	for (int i = 0; i < 3; i++) {
+		span.step_x[i] = e.a[i] * SUBPIXEL_ONE;
+		span.z[i] = rt.screen[i].z();
+	}
+	span.inv_area = e.inv_area;
+
+	// walk the bounding box block by block, skipping blocks whose stored depth already hides the triangle
+	float z_span[SPAN_WIDTH];
+	float equal_span[SPAN_WIDTH];
+	long long passed = 0;
+	for (int by = miny / HIZ_BLOCK; by <= maxy / HIZ_BLOCK; by++) {
+		int block_y0 = max(miny, by * HIZ_BLOCK);
+		int block_y1 = min(maxy, by * HIZ_BLOCK + HIZ_BLOCK - 1);
+		for (int bx = minx / HIZ_BLOCK; bx <= maxx / HIZ_BLOCK; bx++) {
+			// z_reject is strictly below every depth of the triangle, so an equal depth is impossible as well
+			float& block_max = hiz_max_depth[by * hiz_width + bx];
+			if (pass == RasterPass::DepthEqual ? rt.z_reject > block_max : rt.z_reject >= block_max)
 				continue;
+
+			int block_x0 = max(minx, bx * HIZ_BLOCK);
+			int block_x1 = min(maxx, bx * HIZ_BLOCK + HIZ_BLOCK - 1);
+			bool written = false;
+			for (int y = block_y0; y <= block_y1; y++) {
+				// edge values at the first pixel center of this block row
+				for (int i = 0; i < 3; i++)
+					span.w[i] = e.a[i] * ((int64_t)block_x0 * SUBPIXEL_ONE + SUBPIXEL_ONE / 2)
+						+ e.b[i] * ((int64_t)y * SUBPIXEL_ONE + SUBPIXEL_ONE / 2) + e.c[i];
+
+				float* depth_row = &depth_buffer[(height - 1 - y) * width];
+				int count = block_x1 - block_x0 + 1;
+				if (pass == RasterPass::DepthEqual) {
+					// z < next float above the stored depth <=> z == stored depth, the kernels stay unchanged
+					float* equal_row = &prepass_depth[(height - 1 - y) * width];
+					for (int i = 0; i < count; i++)
+						equal_span[i] = nextafter(equal_row[block_x0 + i], numeric_limits<float>::infinity());
+					unsigned mask = test_span(span, equal_span, count, z_span);
+					passed += popcount(mask);
+					for (unsigned m = mask; m != 0; m &= m - 1)
+						equal_row[block_x0 + countr_zero(m)] = -numeric_limits<float>::infinity(); // first equal fragment wins, like the less test
+					if (state.hasShader())
+						shadeSpan(state, rt, span, mask, block_x0, y);
+					continue;
+				}
+
+				unsigned mask = test_span(span, depth_row + block_x0, count, z_span);
+				written |= mask != 0;
+				passed += popcount(mask);
+				if (pass == RasterPass::DepthOnly) {
+					for (; mask != 0; mask &= mask - 1) {
+						int i = countr_zero(mask);
+						depth_row[block_x0 + i] = z_span[i];
+					}
+					continue;
+				}
+
+				// shade the covered pixels that passed the depth test, or store them in the G-buffer
+				for (unsigned m = mask; m != 0; m &= m - 1) {
+					int i = countr_zero(m);
+					depth_row[block_x0 + i] = z_span[i];
+				}
+				if (shading_mode == ShadingMode::Deferred) {
+					for (; mask != 0; mask &= mask - 1) {
+						int i = countr_zero(mask);
+						Shader::FragmentPayload f_p = interpolateFragment(rt, span.w[0] + span.step_x[0] * i,
+							span.w[1] + span.step_x[1] * i, span.w[2] + span.step_x[2] * i);
+						int index = y * width + block_x0 + i;
+						gbuffer.pos[index] = f_p.pos;
+						gbuffer.normal[index] = f_p.normal;
+						gbuffer.text_coord[index] = f_p.text_coord;
+						gbuffer.text_coord_deriv[index] << f_p.text_coord_dx, f_p.text_coord_dy;
+						gbuffer.color[index] = f_p.color;
+						gbuffer.state[index] = rt.state;
+					}
+				}
+				else if (state.hasShader()) {
+					shadeSpan(state, rt, span, mask, block_x0, y);
+				}
 			}
-			
-			float px = x + 0.5;
-			float py = y + 0.5;
-			float alpha, beta, gamma;
-
-			barycentric(px, py,
-				Vec2(vec_screen[0].x(), vec_screen[0].y()),
-				Vec2(vec_screen[1].x(), vec_screen[1].y()),
-				Vec2(vec_screen[2].x(), vec_screen[2].y()),
-				alpha, beta, gamma);
-			if (alpha < 0 || beta < 0 || gamma < 0)
+
+			if (written)
+				block_max = blockMaxDepth(bx, by);
+		}
+	}
+
+	if (pass == RasterPass::DepthEqual) {
+		if (state.hasShader())
+			fragments_shaded += passed;
+		return;
+	}
+	fragments_passed += passed;
+	if (pass == RasterPass::Shade && shading_mode == ShadingMode::Forward && state.hasShader())
+		fragments_shaded += passed;
+}
+
+Shader::FragmentPayload Rasterizer::interpolateFragment(const RasterTriangle& rt, int64_t w0, int64_t w1, int64_t w2) const {
+	const DrawState& state = draw_states[rt.state];
+	const Mat4& model = state.model;
+
+	float alpha = (float)w0 * rt.edges.inv_area;
+	float beta = (float)w1 * rt.edges.inv_area;
+	float gamma = (float)w2 * rt.edges.inv_area;
+
+	// the position is interpolated perspective-correctly, so it is the surface point seen through the pixel
+	// and lies inside the projected bounds light culling bins the lights by
+	float pos_alpha = alpha * rt.inv_w[0], pos_beta = beta * rt.inv_w[1], pos_gamma = gamma * rt.inv_w[2];
+	float pos_scale = 1.0f / (pos_alpha + pos_beta + pos_gamma);
+	pos_alpha *= pos_scale;
+	pos_beta *= pos_scale;
+	pos_gamma *= pos_scale;
+	Vec4 object_pos;
+	Vec3 color, normal;
+	Vec2 text_coord;
+	if (rt.mesh) { // straight from the attribute streams
+		const Mesh& m = *rt.mesh;
+		uint32_t a = rt.vertex[0], b = rt.vertex[1], c = rt.vertex[2];
+		object_pos = Vec4(pos_alpha * m.pos_x[a] + pos_beta * m.pos_x[b] + pos_gamma * m.pos_x[c],
+						pos_alpha * m.pos_y[a] + pos_beta * m.pos_y[b] + pos_gamma * m.pos_y[c],
+						pos_alpha * m.pos_z[a] + pos_beta * m.pos_z[b] + pos_gamma * m.pos_z[c],
+						1.0f);
+		float weight_sum = alpha + beta + gamma; // white vertices, like Mesh::triangle's
+		color = Vec3(weight_sum, weight_sum, weight_sum);
+		normal = Vec3(alpha * m.normal_x[a] + beta * m.normal_x[b] + gamma * m.normal_x[c],
+					alpha * m.normal_y[a] + beta * m.normal_y[b] + gamma * m.normal_y[c],
+					alpha * m.normal_z[a] + beta * m.normal_z[b] + gamma * m.normal_z[c]);
+		text_coord = Vec2(alpha * m.u[a] + beta * m.u[b] + gamma * m.u[c],
+						alpha * m.v[a] + beta * m.v[b] + gamma * m.v[c]);
+	}
+	else {
+		const Triangle& t = *rt.triangle;
+		object_pos = Vec4(pos_alpha * t.vertex[0].x() + pos_beta * t.vertex[1].x() + pos_gamma * t.vertex[2].x(),
+						pos_alpha * t.vertex[0].y() + pos_beta * t.vertex[1].y() + pos_gamma * t.vertex[2].y(),
+						pos_alpha * t.vertex[0].z() + pos_beta * t.vertex[1].z() + pos_gamma * t.vertex[2].z(),
+						1.0f);
+		color = alpha * t.color[0] + beta * t.color[1] + gamma * t.color[2];
+		normal = alpha * t.normal[0] + beta * t.normal[1] + gamma * t.normal[2];
+		text_coord = alpha * t.text_coord[0] + beta * t.text_coord[1] + gamma * t.text_coord[2];
+	}
+	Vec3 pos = (model * object_pos).head<3>();
+	Vec3 transformed_normal = state.normal_matrix * normal;
+	float norm_len = transformed_normal.norm();
+	if (norm_len > 1e-6f) {
+		normal = transformed_normal / norm_len;
+	} else {
+		normal = Vec3(0, 0, 1); // Default to up vector if normal is invalid
+	}
+
+	Shader::FragmentPayload f_p(pos, color, text_coord, normal, state.texture, state.pbr_material);
+	f_p.text_coord_dx = rt.text_coord_dx;
+	f_p.text_coord_dy = rt.text_coord_dy;
+	return f_p;
+}
+
+Vec3 Rasterizer::shadeFragment(const DrawState& state, const Shader::FragmentPayload& f_p, const Shader::LightList& light_list) const {
+	if (state.pbr_kernel)
+		return state.pbr_kernel(*state.pbr_shader, f_p, light_list.lights, skybox ? &*skybox : nullptr);
+	return state.fragment_shader(f_p, light_list.lights);
+}
+
+// shade the fragments of the span at x0 in row y whose bits are set in mask
+void Rasterizer::shadeSpan(const DrawState& state, const RasterTriangle& rt, const RasterSpan& span, unsigned mask, int x0, int y) {
+	static_assert(SPAN_WIDTH <= Shader::BATCH_SIZE, "a span must fit in one shading batch");
+	Shader::FragmentBatch batch;
+	batch.count = 0;
+	batch.pbr_material = state.pbr_material;
+	int x[Shader::BATCH_SIZE];
+	for (; mask != 0; mask &= mask - 1) {
+		int i = countr_zero(mask);
+		Shader::FragmentPayload f_p = interpolateFragment(rt, span.w[0] + span.step_x[0] * i,
+			span.w[1] + span.step_x[1] * i, span.w[2] + span.step_x[2] * i);
+		if (!state.pbr_batch_kernel) {
+			writePixel(x0 + i, y, shadeFragment(state, f_p, tileLights(x0, y)));
+			continue;
+		}
+		batch.set(batch.count, f_p);
+		x[batch.count++] = x0 + i;
+	}
+	if (batch.count > 0)
+		shadeBatch(state, batch, x, y);
+}
+
+// the fragments of a batch lie in one tile
+void Rasterizer::shadeBatch(const DrawState& state, const Shader::FragmentBatch& batch, const int* x, int y) {
+	Vec3 colors[Shader::BATCH_SIZE];
+	state.pbr_batch_kernel(*state.pbr_shader, batch, tileLights(x[0], y), skybox ? &*skybox : nullptr, colors);
+	for (int i = 0; i < batch.count; i++)
+		writePixel(x[i], y, colors[i]);
+}
+
+void Rasterizer::writePixel(int x, int y, const Vec3& shaded_color) {
+	pixel_buffer.at<cv::Vec3b>(y, x)[0] = (uchar)(shaded_color.z() * 255);
+	pixel_buffer.at<cv::Vec3b>(y, x)[1] = (uchar)(shaded_color.y() * 255);
+	pixel_buffer.at<cv::Vec3b>(y, x)[2] = (uchar)(shaded_color.x() * 255);
+}
+
+// Deferred mode: run the fragment shader on the G-buffer pixels inside [x0, x1] x [y0, y1]
+void Rasterizer::shadeGBuffer(int x0, int y0, int x1, int y1) {
+	long long shaded = 0;
+	Shader::FragmentBatch batch;
+	int batch_x[Shader::BATCH_SIZE];
+	for (int y = y0; y <= y1; y++) {
+		// pixels of a row that share a draw state and a tile are shaded together, in batches of up to BATCH_SIZE
+		batch.count = 0;
+		int batch_state = -1;
+		for (int x = x0; x <= x1; x++) {
+			int index = y * width + x;
+			int state_index = gbuffer.state[index];
+			if (state_index < 0)
 				continue;
+			gbuffer.state[index] = -1;
 
-			float z_interpolated = alpha * vec_screen[0].z() + beta * vec_screen[1].z() + gamma * vec_screen[2].z();
-			int idx = (height - 1 - y) * width + x;
-			if (idx < 0 || idx >= (int)depth_buffer.size()) {
+			const DrawState& state = draw_states[state_index];
+			if (!state.hasShader())
+				continue; // Skip if fragment shader not set
+			Shader::FragmentPayload f_p(gbuffer.pos[index], gbuffer.color[index], gbuffer.text_coord[index],
+				gbuffer.normal[index], state.texture, state.pbr_material);
+			f_p.text_coord_dx = gbuffer.text_coord_deriv[index].head<2>();
+			f_p.text_coord_dy = gbuffer.text_coord_deriv[index].tail<2>();
+			shaded++;
+			if (!state.pbr_batch_kernel) {
+				writePixel(x, y, shadeFragment(state, f_p, tileLights(x, y)));
 				continue;
 			}
-			if (z_interpolated < depth_buffer[idx]) {
-				depth_buffer[idx] = z_interpolated;
-
-				Vec4 pos_vec4 = model * Vec4(alpha * t.vertex[0].x() + beta * t.vertex[1].x() + gamma * t.vertex[2].x(),
-										alpha * t.vertex[0].y() + beta * t.vertex[1].y() + gamma * t.vertex[2].y(),
-										alpha * t.vertex[0].z() + beta * t.vertex[1].z() + gamma * t.vertex[2].z(),
-										1.0f);
-				Vec3 pos = pos_vec4.head<3>();
-				Vec3 color = alpha * t.color[0] + beta * t.color[1] + gamma * t.color[2];
-				Vec3 normal = alpha * t.normal[0] + beta * t.normal[1] + gamma * t.normal[2];
-				Vec3 transformed_normal = (model.inverse()).transpose().block<3, 3>(0, 0) * normal;
-				float norm_len = transformed_normal.norm();
-				if (norm_len > 1e-6f) {
-					normal = transformed_normal / norm_len;
-				} else {
-					normal = Vec3(0, 0, 1); // Default to up vector if normal is invalid
-				}
-				Vec2 text_coord = alpha * t.text_coord[0] + beta * t.text_coord[1] + gamma * t.text_coord[2];
-				
-				Shader::FragmentPayload f_p(pos, color, text_coord, normal, texture ? &*texture : nullptr, pbr_material);
-				if (!fragment_shader) {
-					continue; // Skip if fragment shader not set
-				}
-				Vec3 shaded_color = fragment_shader(f_p, lights);
-				
-				// Final bounds check before pixel buffer access
-				if (x >= 0 && x < width && y >= 0 && y < height) {
-					pixel_buffer.at<cv::Vec3b>(y, x)[0] = (uchar)(shaded_color.z() * 255);
-					pixel_buffer.at<cv::Vec3b>(y, x)[1] = (uchar)(shaded_color.y() * 255);
-					pixel_buffer.at<cv::Vec3b>(y, x)[2] = (uchar)(shaded_color.x() * 255);
-				}
+
+			// batch_x[0] is only written once the batch has a fragment
+			if (batch.count == Shader::BATCH_SIZE ||
+				(batch.count > 0 && (state_index != batch_state || x / TILE_SIZE != batch_x[0] / TILE_SIZE))) {
+				shadeBatch(draw_states[batch_state], batch, batch_x, y);
+				batch.count = 0;
 			}
+			batch_state = state_index;
+			batch.pbr_material = state.pbr_material;
+			batch.set(batch.count, f_p);
+			batch_x[batch.count++] = x;
 		}
+		if (batch.count > 0)
+			shadeBatch(draw_states[batch_state], batch, batch_x, y);
 	}
+	fragments_shaded += shaded;
+}
 
-	return;
+float Rasterizer::blockMaxDepth(int bx, int by) const {
+	int x0 = bx * HIZ_BLOCK, x1 = min(x0 + HIZ_BLOCK, width);
+	int y0 = by * HIZ_BLOCK, y1 = min(y0 + HIZ_BLOCK, height);
+	float max_depth = -numeric_limits<float>::infinity();
+	for (int y = y0; y < y1; y++) {
+		const float* depth_row = &depth_buffer[(height - 1 - y) * width];
+		for (int x = x0; x < x1; x++)
+			max_depth = max(max_depth, depth_row[x]);
+	}
+	return max_depth;
 }
 
 void Rasterizer::drawSkybox() {
 	if (!skybox.has_value() || !skybox->isLoaded()) {
 		return;
 	}
+
+	flush(); // the skybox fills whatever the geometry left uncovered
 	
 	// Get camera position from view matrix (assuming view is look-at matrix)
 	Vec3 cam_pos = Vec3(view_inv(0, 3), view_inv(1, 3), view_inv(2, 3));
-	
-	// Render skybox for each pixel
-	for (int y = 0; y < height; y++) {
+
+	// world space ray from the camera to the far plane point of pixel (x, y), done once per frame:
+	// for a perspective projection that point is affine in the pixel coordinates, so every other ray
+	// is the first pixel's ray plus a per-column and a per-row step
+	Mat4 proj_inv = projection.inverse();
+	auto far_ray = [&](float x, float y) {
+		Vec4 view_pos = proj_inv * Vec4((x + 0.5f) / width * 2.0f - 1.0f, 1.0f - (y + 0.5f) / height * 2.0f, 1.0f, 1.0f);
+		view_pos /= view_pos.w();
+		return Vec3((view_inv * view_pos).head<3>() - cam_pos);
+	};
+	if (std::abs((proj_inv * Vec4(0.0f, 0.0f, 1.0f, 1.0f)).w()) < 1e-6f) {
+		return; // Skip if w is too small
+	}
+	Vec3 ray_origin = far_ray(0.0f, 0.0f);
+	Vec3 ray_dx = (far_ray((float)width, 0.0f) - ray_origin) / (float)width;
+	Vec3 ray_dy = (far_ray(0.0f, (float)height) - ray_origin) / (float)height;
+
+	// Render skybox for each pixel of row y; the cubemap lookup does not need a normalized direction
+	auto draw_row = [&](int y) {
+		Vec3 row_ray = ray_origin + ray_dy * (float)y;
+		const float* depth_row = &depth_buffer[(height - 1 - y) * width];
+		const float* hiz_row = &hiz_max_depth[(y / HIZ_BLOCK) * hiz_width];
+		cv::Vec3b* pixel_row = pixel_buffer.ptr<cv::Vec3b>(y);
 		for (int x = 0; x < width; x++) {
-			// Only render skybox where depth buffer is infinity (background)
-			// Bounds check for index calculation
-			if (y < 0 || y >= height || x < 0 || x >= width) {
-				continue;
-			}
-			int idx = (height - 1 - y) * width + x;
-			if (idx < 0 || idx >= (int)depth_buffer.size()) {
+			// skip blocks that geometry covers completely
+			if (hiz_row[x / HIZ_BLOCK] < 1.0f) {
+				x = min(width, (x / HIZ_BLOCK + 1) * HIZ_BLOCK) - 1;
 				continue;
 			}
-			if (depth_buffer[idx] >= 1.0f) {
-				// Calculate ray direction for this pixel
-				float ndc_x = (x + 0.5f) / width * 2.0f - 1.0f;
-				float ndc_y = 1.0f - (y + 0.5f) / height * 2.0f;
-				float ndc_z = 1.0f; // Far plane
-				
-				// Transform to world space
-				Mat4 proj_inv = projection.inverse();
-				Vec4 clip_pos = Vec4(ndc_x, ndc_y, ndc_z, 1.0f);
-				Vec4 view_pos = proj_inv * clip_pos;
-				if (std::abs(view_pos.w()) < 1e-6f) {
-					continue; // Skip if w is too small
-				}
-				view_pos /= view_pos.w();
-				
-				Vec4 world_pos = view_inv * view_pos;
-				Vec3 direction_vec = world_pos.head<3>() - cam_pos;
-				float dir_len = direction_vec.norm();
-				Vec3 direction;
-				if (dir_len > 1e-6f) {
-					direction = direction_vec / dir_len;
-				} else {
-					direction = Vec3(0, 0, 1); // Default direction if invalid
-				}
-				
-				// Sample skybox
-				Vec3 sky_color = skybox->getColor(direction);
-				
-				// Final bounds check before pixel buffer access
-				if (y >= 0 && y < height && x >= 0 && x < width) {
-					pixel_buffer.at<cv::Vec3b>(y, x)[0] = (uchar)(std::clamp(sky_color.z() * 255.0f, 0.0f, 255.0f));
-					pixel_buffer.at<cv::Vec3b>(y, x)[1] = (uchar)(std::clamp(sky_color.y() * 255.0f, 0.0f, 255.0f));
-					pixel_buffer.at<cv::Vec3b>(y, x)[2] = (uchar)(std::clamp(sky_color.x() * 255.0f, 0.0f, 255.0f));
-				}
+			// Only render skybox where depth buffer is infinity (background)
+			if (depth_row[x] >= 1.0f) {
+				Vec3 sky_color = skybox->getColor(row_ray + ray_dx * (float)x);
+				pixel_row[x] = cv::Vec3b(
+					(uchar)(std::clamp(sky_color.z() * 255.0f, 0.0f, 255.0f)),
+					(uchar)(std::clamp(sky_color.y() * 255.0f, 0.0f, 255.0f)),
+					(uchar)(std::clamp(sky_color.x() * 255.0f, 0.0f, 255.0f)));
 			}
 		}
-	}
+	};
+
+	// rows write disjoint parts of pixel_buffer
+	if (thread_pool)
+		thread_pool->parallelFor(height, draw_row);
+	else
+		for (int y = 0; y < height; y++)
+			draw_row(y);
 }
@@ -1,12 +1,21 @@
 #pragma once
 
 #include "triangle.hpp"
+#include "mesh.hpp"
 #include "texture.hpp"
 #include "shader.hpp"
 #include "skybox.hpp"
 #include "material.hpp"
+#include "thread_pool.hpp"
+#include "geometry.hpp"
+#include "raster_kernel.hpp"
 #include <vector>
+#include <deque>
 #include <optional>
+#include <memory>
+#include <atomic>
+#include <span>
+#include <cstdint>
 #include <opencv2/opencv.hpp>
 #include <Eigen/Eigen>
 
@@ -33,13 +42,118 @@ public:
 	void setTexture(Texture t);
 	void setSkybox(const Skybox& skybox);
 	void setPBRMaterial(PBRMaterial* material);
+	// shade with the shader's PBR kernel specialized for each draw's material and the skybox set here,
+	// instead of the fragment shader function; the kernel is picked when a draw captures its render
+	// state, shader settings apply from the next state change or clear(). nullptr: use the function
+	void setPBRShader(const Shader* shader);
 
-	cv::Mat getPixels() const;
+	// true: hand the PBR shader's kernel the fragments of a raster span together; measured slower than
+	// the scalar path on the bundled scenes, so it stays opt-in
+	// false: call the scalar kernel once per fragment (default), the reference for the batched path
+	void setBatchShading(bool enabled);
+	bool getBatchShading() const;
+
+	// lights of the following draws, none by default. The list is converted once here, so an animated
+	// scene sets its lights once per frame; pending triangles are shaded with the previous ones first
+	void setLights(const vector<Shader::Light>& lights);
+	const vector<Shader::Light>& getLights() const;
+
+	// n > 0: a tile evaluates at most n lights, the ones with the largest intensity times squared radius,
+	// bounding the shading cost of crowded tiles at the price of dropping weak lights there
+	// 0: no limit (default)
+	void setLightLimit(int n);
+	int getLightLimit() const;
+
+	// true: bin the lights into the screen tiles their radius can reach, so a fragment only evaluates
+	// the lights of its tile (default); false: every tile gets every light. Same output either way
+	void setLightCulling(bool enabled);
+	bool getLightCulling() const;
+
+	// 1: draw every triangle immediately on the calling thread (default)
+	// n > 1: bin triangles into screen tiles and rasterize the tiles on n threads, 0: one thread per core
+	// output is bit-identical in both modes; the fragment shader must be safe to call concurrently
+	void setThreadCount(int n);
+	int getThreadCount() const;
+
+	// coverage and depth test kernel, defaults to the widest SIMD kernel the CPU supports
+	void setRasterKernel(RasterKernel kernel);
+	RasterKernel getRasterKernel() const;
+
+	// Forward: shade every fragment that passes the depth test (default)
+	// Deferred: store the visible fragment of every pixel in a G-buffer and shade each pixel once in flush()
+	// ZPrepass: record the triangles, in flush() rasterize them depth-only, then again with an equal depth test
+	// that shades only the visible fragment
+	enum class ShadingMode { Forward, Deferred, ZPrepass };
+	void setShadingMode(ShadingMode mode);
+	ShadingMode getShadingMode() const;
+
+	struct FrameStats { // counted since the last clear()
+		long long fragments_passed; // fragments that passed the depth test
+		long long fragments_shaded; // fragment shader invocations
+		long long pixels_covered;   // pixels covered by geometry, overdraw = fragments_shaded / pixels_covered
+	};
+	FrameStats getFrameStats();
+
+	cv::Mat getPixels();
 
 	void drawTriangle(const Triangle& t);
+	void drawTriangles(span<const Triangle> triangles); // batch draw, render state is set up once for all triangles
+	// indexed draw of index_count indices from first_index on (default: all, first_index a multiple of 3
+	// like a SubMesh's), each referenced vertex is
+	// transformed once per draw and shared by its triangles; output matches drawing mesh.triangle(t).
+	// Fragments read the attributes from the mesh, which must stay unchanged until the next flush()
+	void drawMesh(const Mesh& mesh, uint32_t first_index = 0, uint32_t index_count = UINT32_MAX);
 	void drawSkybox();
+	void flush(); // rasterize all triangles still waiting in the draw list
 
 private:
+	static const int TILE_SIZE = 64;
+	static const int HIZ_BLOCK = SPAN_WIDTH; // side of the coarse depth blocks, TILE_SIZE must be a multiple
+
+	enum class RasterPass {
+		Shade,     // depth test and write, then shade or store in the G-buffer
+		DepthOnly, // depth test and write
+		DepthEqual // shade fragments whose depth equals the stored one, each pixel at most once
+	};
+
+	struct DrawState { // render state captured for the triangles drawn with it
+		Mat4 model;
+		Mat4 mvp;           // projection * view * model
+		Mat3 normal_matrix; // inverse transpose of the model matrix, transforms normals
+		function<Vec3(const Shader::FragmentPayload&, const vector<Shader::Light>&)> fragment_shader;
+		Shader::PBRKernel pbr_kernel; // replaces fragment_shader when set
+		Shader::PBRBatchKernel pbr_batch_kernel; // replaces pbr_kernel when set
+		const Shader* pbr_shader;
+		Texture* texture;
+		PBRMaterial* pbr_material;
+
+		bool hasShader() const { return pbr_kernel || fragment_shader; }
+	};
+
+	struct RasterTriangle { // triangle after vertex processing, ready for scan conversion
+		const Mesh* mesh;           // mesh draws: attributes of mesh's vertices vertex[0..2], else
+		const Triangle* triangle;   // triangle draws: its attributes
+		uint32_t vertex[3];
+		Vec3 screen[3];
+		float inv_w[3];             // 1 / clip w of the vertices, for perspective-correct positions
+		EdgeFunctions edges;
+		bool fits_int32;            // edge values inside the bounding box fit the SIMD kernels
+		int minx, maxx, miny, maxy; // screen bounding box, clamped to the viewport
+		float z_reject;             // blocks with a max depth at or below this are hidden
+		Vec2 text_coord_dx;         // change of the texture coordinates per pixel step in x and y
+		Vec2 text_coord_dy;
+		int state;                  // index into draw_states
+	};
+
+	struct GBuffer { // attributes of the visible fragment of every pixel, one array per attribute
+		vector<Vec3> pos;
+		vector<Vec3> normal;
+		vector<Vec2> text_coord;
+		vector<Vec4> text_coord_deriv; // text_coord_dx, text_coord_dy
+		vector<Vec3> color;
+		vector<int> state; // index into draw_states, -1: nothing to shade
+	};
+
 	int width, height;
 
 	Mat4 model;
@@ -51,9 +165,62 @@ private:
 	optional<Texture> texture;
 	optional<Skybox> skybox;
 	PBRMaterial* pbr_material;
+	const Shader* pbr_shader;
+	bool batch_shading;
+	Shader::LightList lights;
+	vector<int> light_order; // indices into lights, by decreasing intensity times squared radius
+	int light_limit;
+	bool light_culling;
+	bool lights_dirty; // lights changed since tile_lights was built
+	Mat4 tile_lights_view_projection; // camera tile_lights was built for
+	vector<Shader::LightList> tile_lights; // lights reaching each tile, indexed like tile_bins
 	
 	Mat4 view_inv;
 
+	RasterKernel raster_kernel;
+	RasterSpanFunction raster_span;
+
 	cv::Mat pixel_buffer; // store color of each pixel, provide to OpenCV to draw image
 	vector<float> depth_buffer;
+
+	// coarse depth: max depth of every HIZ_BLOCK x HIZ_BLOCK block of depth_buffer, indexed by screen y
+	int hiz_width, hiz_height;
+	vector<float> hiz_max_depth;
+
+	ShadingMode shading_mode;
+	GBuffer gbuffer;      // indexed by y * width + x, only allocated in deferred mode
+	bool gbuffer_pending; // G-buffer holds fragments that are not shaded yet
+	vector<float> prepass_depth; // depth_buffer after the depth-only pass, -inf once the pixel is shaded
+
+	atomic<long long> fragments_passed;
+	atomic<long long> fragments_shaded;
+
+	// tiled mode and z-prepass
+	unique_ptr<ThreadPool> thread_pool;
+	int tiles_x, tiles_y;
+	vector<DrawState> draw_states;
+	bool state_dirty; // render state changed since draw_states.back() was captured
+	vector<RasterTriangle> raster_triangles; // draw list, replayed in flush()
+	deque<Triangle> triangle_copies; // triangles of drawTriangles in the draw list, a deque keeps their addresses
+	vector<vector<int>> tile_bins; // indices into raster_triangles, in submission order, only in tiled mode
+
+	// post-transform vertex cache of drawMesh: clip position of a mesh vertex, valid while its stamp is the draw's
+	vector<Vec4> clip_cache;
+	vector<uint32_t> clip_stamp;
+	uint32_t draw_stamp;
+
+	void captureDrawState();
+	bool setupTriangle(const Vec4 clip[3], const Vec2 text_coord[3], RasterTriangle& rt) const;
+	void submitTriangle(const RasterTriangle& rt);
+	void replayDrawList(RasterPass pass);
+	void rasterizeTriangle(const RasterTriangle& rt, RasterPass pass, int x0, int y0, int x1, int y1);
+	Shader::FragmentPayload interpolateFragment(const RasterTriangle& rt, int64_t w0, int64_t w1, int64_t w2) const;
+	void cullLights(const Mat4& view_projection);
+	const Shader::LightList& tileLights(int x, int y) const;
+	Vec3 shadeFragment(const DrawState& state, const Shader::FragmentPayload& f_p, const Shader::LightList& light_list) const;
+	void shadeSpan(const DrawState& state, const RasterTriangle& rt, const RasterSpan& span, unsigned mask, int x0, int y);
+	void shadeBatch(const DrawState& state, const Shader::FragmentBatch& batch, const int* x, int y);
+	void writePixel(int x, int y, const Vec3& shaded_color);
+	void shadeGBuffer(int x0, int y0, int x1, int y1);
+	float blockMaxDepth(int bx, int by) const;
 };
@@ -3,10 +3,54 @@
 #include "skybox.hpp"
 #include <cmath>
 #include <algorithm>
+#include <array>
+#include <utility>
 #include <opencv2/opencv.hpp>
 #include <Eigen/Eigen>
 
 const double PI = 3.14159265358979323846;
+const int GAMMA_LUT_SIZE = 1024;
+
+// features a pbrShader variant is compiled for, the variant index is the combination of the bits
+enum PBRFeature : unsigned {
+	PBR_MATERIAL = 1,       // fragment has a PBRMaterial
+	PBR_ALBEDO_MAP = 2,
+	PBR_ORM_MAP = 4,        // otherwise the separate metallic / roughness / AO maps are checked per fragment
+	PBR_NORMAL_MAP = 8,
+	PBR_SKYBOX = 16,        // image based lighting from a loaded skybox
+	PBR_FAST_MATH = 32,
+	PBR_VARIANTS = 64
+};
+
+// Light::window for the batch kernels, which read the squared radius from a LightList
+static float lightWindow(float distance_squared, float radius_squared) {
+	float x = distance_squared / radius_squared;
+	float w = std::clamp(1.0f - x * x, 0.0f, 1.0f);
+	return w * w;
+}
+
+// filtered lookup at the mip level that matches the fragment's footprint on the texture
+static Vec3 sampleTexture(const Texture& texture, const Vec2& text_coord_dx, const Vec2& text_coord_dy, float u, float v) {
+	return texture.sample(u, v, texture.lod(text_coord_dx, text_coord_dy));
+}
+
+static Vec3 sampleTexture(const Texture& texture, const Shader::FragmentPayload& fragment_payload, float u, float v) {
+	return sampleTexture(texture, fragment_payload.text_coord_dx, fragment_payload.text_coord_dy, u, v);
+}
+
+// x^(1/2.2) for x in [0, 1], tabulated over sqrt(x) where the curve is close to linear, so
+// interpolating between entries stays far below one 8-bit step even next to 0
+static float gammaEncodeFast(float x) {
+	static const array<float, GAMMA_LUT_SIZE + 1> table = [] {
+		array<float, GAMMA_LUT_SIZE + 1> t;
+		for (int i = 0; i <= GAMMA_LUT_SIZE; i++)
+			t[i] = pow((float)i / GAMMA_LUT_SIZE, 2.0f / 2.2f);
+		return t;
+	}();
+	float s = sqrt(std::clamp(x, 0.0f, 1.0f)) * GAMMA_LUT_SIZE;
+	int i = min((int)s, GAMMA_LUT_SIZE - 1);
+	return table[i] + (table[i + 1] - table[i]) * (s - i);
+}
 
 Shader::Shader() {
 	ks = Vec3(0.7937, 0.7937, 0.7937);
@@ -16,6 +60,15 @@ Shader::Shader() {
 	kh = 0.2f;
 	kn = 0.1f;
 	eye_pos = Vec3(0, 0, 10);
+	pbr_math = PBRMath::Exact;
+}
+
+void Shader::setPBRMath(PBRMath math) {
+	pbr_math = math;
+}
+
+Shader::PBRMath Shader::getPBRMath() const {
+	return pbr_math;
 }
 
 Vec3 Shader::vertexShader(const VertexPayload& vertex_payload) {
@@ -30,7 +83,7 @@ Vec3 Shader::phongShader(const FragmentPayload& fragment_payload, const vector<L
 	float view_dir_len = view_dir_vec.norm();
 	Vec3 view_dir = (view_dir_len > 1e-6f) ? (view_dir_vec / view_dir_len) : Vec3(0, 0, 1);
 
-	for (auto light : lights) {
+	for (const auto& light : lights) {
 		Vec3 ls(0, 0, 0); // specular highlight
 		Vec3 ld(0, 0, 0); // diffuse reflection
 		Vec3 la(0, 0, 0); // ambient light
@@ -42,9 +95,10 @@ Vec3 Shader::phongShader(const FragmentPayload& fragment_payload, const vector<L
 		float half_dir_len = half_dir_vec.norm();
 		Vec3 half_dir = (half_dir_len > 1e-6f) ? (half_dir_vec / half_dir_len) : Vec3(0, 0, 1);
 		float r_square = (light.pos - fragment_payload.pos).squaredNorm();
+		float window = light.window(r_square);
 
 		for (size_t j = 0; j < 3; j++) {
-			float i = light.intensity[j] / r_square;
+			float i = light.intensity[j] * window / r_square;
 			ls[j] = ks[j] * i * pow(max(0.0f, fragment_payload.normal.dot(half_dir)), 150.0f);
 			ld[j] = kd[j] * i * max(0.0f, fragment_payload.normal.dot(light_dir));
 			la[j] = ka[j] * ia[j];
@@ -64,12 +118,12 @@ Vec3 Shader::textureShader(const FragmentPayload& fragment_payload, const vector
 	float u = std::clamp(fragment_payload.text_coord.x(), 0.0f, 1.0f);
 	float v = std::clamp(fragment_payload.text_coord.y(), 0.0f, 1.0f);
 	
-	kd = fragment_payload.texture->getColor(u, v) * (1.0f / 255.0f);
+	kd = sampleTexture(*fragment_payload.texture, fragment_payload, u, v);
 	Vec3 view_dir_vec = eye_pos - fragment_payload.pos;
 	float view_dir_len = view_dir_vec.norm();
 	Vec3 view_dir = (view_dir_len > 1e-6f) ? (view_dir_vec / view_dir_len) : Vec3(0, 0, 1);
 
-	for (auto light : lights) {
+	for (const auto& light : lights) {
 		Vec3 ls(0, 0, 0); // specular highlight
 		Vec3 ld(0, 0, 0); // diffuse reflection
 		Vec3 la(0, 0, 0); // ambient light
@@ -81,9 +135,10 @@ Vec3 Shader::textureShader(const FragmentPayload& fragment_payload, const vector
 		float half_dir_len = half_dir_vec.norm();
 		Vec3 half_dir = (half_dir_len > 1e-6f) ? (half_dir_vec / half_dir_len) : Vec3(0, 0, 1);
 		float r_square = (light.pos - fragment_payload.pos).squaredNorm();
+		float window = light.window(r_square);
 
 		for (size_t j = 0; j < 3; j++) {
-			float i = light.intensity[j] / r_square;
+			float i = light.intensity[j] * window / r_square;
 			ls[j] = ks[j] * i * pow(max(0.0f, fragment_payload.normal.dot(half_dir)), 150.0f);
 			ld[j] = kd[j] * i * max(0.0f, fragment_payload.normal.dot(light_dir));
 			la[j] = ka[j] * ia[j];
@@ -119,14 +174,16 @@ Vec3 Shader::normalShader(const FragmentPayload& fragment_payload, const vector<
 	float v = std::clamp(fragment_payload.text_coord.y(), 0.0f, 1.0f);
 	float u_next = min(u + 1.0f / w, 1.0f);
 	float v_next = min(v + 1.0f / h, 1.0f);
-	float d_u = kh * kn * (fragment_payload.texture->getColor(u_next, v).norm() - fragment_payload.texture->getColor(u, v).norm());
-	float d_v = kh * kn * (fragment_payload.texture->getColor(u, v_next).norm() - fragment_payload.texture->getColor(u, v).norm());
+	// kh and kn are tuned for heights in texel values of [0, 255]
+	float height = fragment_payload.texture->getColor(u, v).norm() * 255.0f;
+	float d_u = kh * kn * (fragment_payload.texture->getColor(u_next, v).norm() * 255.0f - height);
+	float d_v = kh * kn * (fragment_payload.texture->getColor(u, v_next).norm() * 255.0f - height);
 
 	Vec3 new_tangent(-d_u, -d_v, 1.0);
 	Vec3 new_normal_vec = tbn * new_tangent;
 	float new_normal_len = new_normal_vec.norm();
 	Vec3 new_normal = (new_normal_len > 1e-6f) ? (new_normal_vec / new_normal_len) : normal;
-	Vec3 new_pos = fragment_payload.pos + new_normal * fragment_payload.texture->getColor(u, v).norm() * kn;
+	Vec3 new_pos = fragment_payload.pos + new_normal * height * kn;
 	
 
 	// phong
@@ -137,7 +194,7 @@ Vec3 Shader::normalShader(const FragmentPayload& fragment_payload, const vector<
 	float view_dir_len = view_dir_vec.norm();
 	Vec3 view_dir = (view_dir_len > 1e-6f) ? (view_dir_vec / view_dir_len) : Vec3(0, 0, 1);
 
-	for (auto light : lights) {
+	for (const auto& light : lights) {
 		Vec3 ls(0, 0, 0); // specular highlight
 		Vec3 ld(0, 0, 0); // diffuse reflection
 		Vec3 la(0, 0, 0); // ambient light
@@ -149,9 +206,10 @@ Vec3 Shader::normalShader(const FragmentPayload& fragment_payload, const vector<
 		float half_dir_len = half_dir_vec.norm();
 		Vec3 half_dir = (half_dir_len > 1e-6f) ? (half_dir_vec / half_dir_len) : Vec3(0, 0, 1);
 		float r_square = (light.pos - new_pos).squaredNorm();
+		float window = light.window(r_square);
 
 		for (size_t j = 0; j < 3; j++) {
-			float i = light.intensity[j] / r_square;
+			float i = light.intensity[j] * window / r_square;
 			ls[j] = ks[j] * i * pow(max(0.0f, new_normal.dot(half_dir)), 150.0f);
 			ld[j] = kd[j] * i * max(0.0f, new_normal.dot(light_dir));
 			la[j] = ka[j] * ia[j];
@@ -165,7 +223,7 @@ Vec3 Shader::normalShader(const FragmentPayload& fragment_payload, const vector<
 	return result_color;
 }
 
-float Shader::distributionGGX(const Vec3& normal, const Vec3& half_dir, float roughness) {
+float Shader::distributionGGX(const Vec3& normal, const Vec3& half_dir, float roughness) const {
 	float a = roughness * roughness;
 	float a_squared = a * a;
 	float n_dot_h = max(normal.dot(half_dir), 0.0f);
@@ -178,7 +236,7 @@ float Shader::distributionGGX(const Vec3& normal, const Vec3& half_dir, float ro
 	return num / max(denom, 0.0000001f);
 }
 
-float Shader::geometrySchlickGGX(float n_dot_v, float roughness) {
+float Shader::geometrySchlickGGX(float n_dot_v, float roughness) const {
 	float r = (roughness + 1.0f);
 	float k = (r * r) / 8.0f;
 	
@@ -188,7 +246,7 @@ float Shader::geometrySchlickGGX(float n_dot_v, float roughness) {
 	return num / max(denom, 0.0000001f);
 }
 
-float Shader::geometrySmith(const Vec3& normal, const Vec3& view_dir, const Vec3& light_dir, float roughness) {
+float Shader::geometrySmith(const Vec3& normal, const Vec3& view_dir, const Vec3& light_dir, float roughness) const {
 	float n_dot_v = max(normal.dot(view_dir), 0.0f);
 	float n_dot_l = max(normal.dot(light_dir), 0.0f);
 	float ggx_2 = geometrySchlickGGX(n_dot_v, roughness);
@@ -197,42 +255,57 @@ float Shader::geometrySmith(const Vec3& normal, const Vec3& view_dir, const Vec3
 	return ggx_1 * ggx_2;
 }
 
-Vec3 Shader::fresnelSchlick(float cos_theta, const Vec3& fresnel) {
+Vec3 Shader::fresnelSchlick(float cos_theta, const Vec3& fresnel) const {
 	return fresnel + (Vec3(1.0f, 1.0f, 1.0f) - fresnel) * pow(std::clamp(1.0f - cos_theta, 0.0f, 1.0f), 5.0f);
 }
 
-Vec3 Shader::pbrShader(const FragmentPayload& fragment_payload, const vector<Light>& lights, const Skybox* skybox) {
+Vec3 Shader::fresnelSchlickRoughness(float cos_theta, const Vec3& fresnel, float roughness) const {
+	Vec3 grazing = fresnel.cwiseMax(Vec3(1.0f - roughness, 1.0f - roughness, 1.0f - roughness));
+	return fresnel + (grazing - fresnel) * pow(std::clamp(1.0f - cos_theta, 0.0f, 1.0f), 5.0f);
+}
+
+template <unsigned FEATURES>
+Vec3 Shader::pbrShading(const FragmentPayload& fragment_payload, const vector<Light>& lights, const Skybox* skybox) const {
 	Vec3 albedo = fragment_payload.color;
 	float metallic = 0.0f;
 	float roughness = 0.5f;
+	float ao = 1.0f;
 	float normal_len = fragment_payload.normal.norm();
 	Vec3 normal = (normal_len > 1e-6f) ? (fragment_payload.normal / normal_len) : Vec3(0, 0, 1);
 	
-	if (fragment_payload.pbr_material) {
+	if constexpr ((FEATURES & PBR_MATERIAL) != 0) {
 		float u = std::clamp(fragment_payload.text_coord.x(), 0.0f, 1.0f);
 		float v = std::clamp(fragment_payload.text_coord.y(), 0.0f, 1.0f);
 		
-		if (fragment_payload.pbr_material->hasAlbedoMap())
-			albedo = fragment_payload.pbr_material->albedo_map->getColor(u, v) * (1.0f / 255.0f);
+		if constexpr ((FEATURES & PBR_ALBEDO_MAP) != 0)
+			albedo = sampleTexture(*fragment_payload.pbr_material->albedo_map, fragment_payload, u, v);
 		else
 			albedo = fragment_payload.pbr_material->albedo;
 		
-		if (fragment_payload.pbr_material->hasMetallicMap()) {
-			Vec3 metallic_color = fragment_payload.pbr_material->metallic_map->getColor(u, v) * (1.0f / 255.0f);
-			metallic = (metallic_color.x() + metallic_color.y() + metallic_color.z()) / 3.0f;
+		if constexpr ((FEATURES & PBR_ORM_MAP) != 0) {
+			// one fetch for AO, roughness and metallic
+			Vec3 orm = sampleTexture(*fragment_payload.pbr_material->orm_map, fragment_payload, u, v);
+			ao = orm.x();
+			roughness = orm.y();
+			metallic = orm.z();
+		}
+		else {
+			if (fragment_payload.pbr_material->hasMetallicMap())
+				metallic = sampleTexture(*fragment_payload.pbr_material->metallic_map, fragment_payload, u, v).x();
+			else
+				metallic = fragment_payload.pbr_material->metallic;
+
+			if (fragment_payload.pbr_material->hasRoughnessMap())
+				roughness = sampleTexture(*fragment_payload.pbr_material->roughness_map, fragment_payload, u, v).x();
+			else
+				roughness = fragment_payload.pbr_material->roughness;
+
+			if (fragment_payload.pbr_material->hasAOMap())
+				ao = sampleTexture(*fragment_payload.pbr_material->ao_map, fragment_payload, u, v).x();
 		}
-		else
-			metallic = fragment_payload.pbr_material->metallic;
-		
-		if (fragment_payload.pbr_material->hasRoughnessMap()) {
-			Vec3 roughness_color = fragment_payload.pbr_material->roughness_map->getColor(u, v) * (1.0f / 255.0f);
-			roughness = (roughness_color.x() + roughness_color.y() + roughness_color.z()) / 3.0f;
-		} 
-		else
-			roughness = fragment_payload.pbr_material->roughness;
 		
-		if (fragment_payload.pbr_material->hasNormalMap()) {
-			Vec3 normal_color = fragment_payload.pbr_material->normal_map->getColor(u, v) * (1.0f / 255.0f);
+		if constexpr ((FEATURES & PBR_NORMAL_MAP) != 0) {
+			Vec3 normal_color = sampleTexture(*fragment_payload.pbr_material->normal_map, fragment_payload, u, v);
 			Vec3 tangent_normal = normal_color * 2.0f - Vec3(1.0f, 1.0f, 1.0f);
 			Vec3 new_normal_vec = normal + tangent_normal * 0.5f;
 			float new_normal_len = new_normal_vec.norm();
@@ -248,56 +321,388 @@ Vec3 Shader::pbrShader(const FragmentPayload& fragment_payload, const vector<Lig
 	fresnel = fresnel * (1.0f - metallic) + albedo * metallic;
 	
 	Vec3 result_color(0, 0, 0);
+	constexpr bool fast = (FEATURES & PBR_FAST_MATH) != 0;
 	
-	for (const auto& light : lights) {
-		Vec3 light_dir_vec = light.pos - fragment_payload.pos;
-		float light_dir_len = light_dir_vec.norm();
-		Vec3 light_dir = (light_dir_len > 1e-6f) ? (light_dir_vec / light_dir_len) : Vec3(0, 0, 1);
-		Vec3 half_dir_vec = view_dir + light_dir;
-		float half_dir_len = half_dir_vec.norm();
-		Vec3 half_dir = (half_dir_len > 1e-6f) ? (half_dir_vec / half_dir_len) : Vec3(0, 0, 1);
-		float distance = (light.pos - fragment_payload.pos).norm();
-		float attenuation = 1.0f / (distance * distance);
-		Vec3 radiance = light.intensity * attenuation;
+	if constexpr (fast) {
+		// D * G * F / (4 * n_dot_v * n_dot_l) times n_dot_l: with Schlick-GGX the n_dot_v and n_dot_l of G
+		// cancel against the denominator, the per-fragment factors are hoisted out of the light loop
+		float a_squared = roughness * roughness * roughness * roughness;
+		float k = (roughness + 1.0f) * (roughness + 1.0f) / 8.0f;
+		float n_dot_v = max(normal.dot(view_dir), 0.0f);
+		float specular_scale = n_dot_v > 0.0f ? 1.0f / ((float)(4.0 * PI) * (n_dot_v * (1.0f - k) + k)) : 0.0f; // no highlight facing away
+		Vec3 diffuse = albedo * (1.0f - metallic) / PI;
+		for (const auto& light : lights) {
+			Vec3 light_dir_vec = light.pos - fragment_payload.pos;
+			float distance_squared = light_dir_vec.squaredNorm();
+			float n_dot_l_len = normal.dot(light_dir_vec);
+			if (n_dot_l_len <= 0.0f || distance_squared < 1e-12f)
+				continue;
+			float inv_distance = 1.0f / sqrt(distance_squared);
+			Vec3 light_dir = light_dir_vec * inv_distance;
+			float n_dot_l = n_dot_l_len * inv_distance;
+			Vec3 half_dir_vec = view_dir + light_dir;
+			float half_dir_len_squared = half_dir_vec.squaredNorm();
+			Vec3 half_dir = half_dir_len_squared > 1e-12f ? Vec3(half_dir_vec / sqrt(half_dir_len_squared)) : Vec3(0, 0, 1);
+
+			float n_dot_h = max(normal.dot(half_dir), 0.0f);
+			float x = 1.0f - std::clamp(half_dir.dot(view_dir), 0.0f, 1.0f);
+			float x_squared = x * x;
+			Vec3 fresnel_factor = fresnel + (Vec3(1.0f, 1.0f, 1.0f) - fresnel) * (x_squared * x_squared * x);
+			float d = n_dot_h * n_dot_h * (a_squared - 1.0f) + 1.0f;
+			float g_l = n_dot_l * (1.0f - k) + k;
+			float specular = a_squared * specular_scale / max(d * d * g_l, 0.0000001f);
+
+			Vec3 k_d = Vec3(1.0f, 1.0f, 1.0f) - fresnel_factor;
+			Vec3 brdf = k_d.cwiseProduct(diffuse) + fresnel_factor * specular;
+			result_color += brdf.cwiseProduct(light.intensity) * (n_dot_l * light.window(distance_squared) / distance_squared);
+		}
+	}
+	else {
+		for (const auto& light : lights) {
+			Vec3 light_dir_vec = light.pos - fragment_payload.pos;
+			float light_dir_len = light_dir_vec.norm();
+			Vec3 light_dir = (light_dir_len > 1e-6f) ? (light_dir_vec / light_dir_len) : Vec3(0, 0, 1);
+			Vec3 half_dir_vec = view_dir + light_dir;
+			float half_dir_len = half_dir_vec.norm();
+			Vec3 half_dir = (half_dir_len > 1e-6f) ? (half_dir_vec / half_dir_len) : Vec3(0, 0, 1);
+			float distance = (light.pos - fragment_payload.pos).norm();
+			float attenuation = light.window(distance * distance) / (distance * distance);
+			Vec3 radiance = light.intensity * attenuation;
 		
-		// Cook-Torrance BRDF
-		float ndf = distributionGGX(normal, half_dir, roughness);
-		float geometry = geometrySmith(normal, view_dir, light_dir, roughness);
-		Vec3 fresnel_factor = fresnelSchlick(max(half_dir.dot(view_dir), 0.0f), fresnel);
+			// Cook-Torrance BRDF
+			float ndf = distributionGGX(normal, half_dir, roughness);
+			float geometry = geometrySmith(normal, view_dir, light_dir, roughness);
+			Vec3 fresnel_factor = fresnelSchlick(max(half_dir.dot(view_dir), 0.0f), fresnel);
 		
-		Vec3 k_s = fresnel_factor;
-		Vec3 k_d = Vec3(1.0f, 1.0f, 1.0f) - k_s;
-		k_d *= 1.0f - metallic;
+			Vec3 k_s = fresnel_factor;
+			Vec3 k_d = Vec3(1.0f, 1.0f, 1.0f) - k_s;
+			k_d *= 1.0f - metallic;
 		
-		Vec3 numerator = ndf * geometry * fresnel_factor;
-		float denominator = 4.0f * max(normal.dot(view_dir), 0.0f) * max(normal.dot(light_dir), 0.0f) + 0.0001f;
-		Vec3 specular = numerator / denominator;
+			Vec3 numerator = ndf * geometry * fresnel_factor;
+			float denominator = 4.0f * max(normal.dot(view_dir), 0.0f) * max(normal.dot(light_dir), 0.0f) + 0.0001f;
+			Vec3 specular = numerator / denominator;
 		
-		float n_dot_l = max(normal.dot(light_dir), 0.0f);
-		result_color += (k_d.cwiseProduct(albedo) / PI + specular).cwiseProduct(radiance) * n_dot_l;
+			float n_dot_l = max(normal.dot(light_dir), 0.0f);
+			result_color += (k_d.cwiseProduct(albedo) / PI + specular).cwiseProduct(radiance) * n_dot_l;
+		}
 	}
 	
 	Vec3 ambient;
-	if (skybox && skybox->isLoaded()) {
-
-		Vec3 ambient_dir = normal;
-		Vec3 skybox_ambient = skybox->getColor(ambient_dir);
-		ambient = skybox_ambient.cwiseProduct(albedo) * 1.0f; 
+	if constexpr ((FEATURES & PBR_SKYBOX) != 0) {
+		// split-sum image based lighting: SH irradiance for the diffuse part, the prefiltered
+		// environment in the reflection direction scaled by the BRDF LUT for the specular part
+		float n_dot_v = max(normal.dot(view_dir), 0.0f);
+		Vec3 k_s = fresnelSchlickRoughness(n_dot_v, fresnel, roughness);
+		Vec3 k_d = (Vec3(1.0f, 1.0f, 1.0f) - k_s) * (1.0f - metallic);
+		Vec3 reflect_dir = normal * (2.0f * normal.dot(view_dir)) - view_dir;
+		Vec2 env_brdf = skybox->getEnvironmentBRDF(n_dot_v, roughness);
+		Vec3 specular = skybox->getSpecular(reflect_dir, roughness).cwiseProduct(fresnel * env_brdf.x() + Vec3(env_brdf.y(), env_brdf.y(), env_brdf.y()));
+		ambient = k_d.cwiseProduct(skybox->getIrradiance(normal)).cwiseProduct(albedo) + specular;
 	} else {
 		ambient = Vec3(0.03f, 0.03f, 0.03f).cwiseProduct(albedo);
 	}
 	
-	if (fragment_payload.pbr_material && fragment_payload.pbr_material->hasAOMap()) {
-		float u = std::clamp(fragment_payload.text_coord.x(), 0.0f, 1.0f);
-		float v = std::clamp(fragment_payload.text_coord.y(), 0.0f, 1.0f);
-		Vec3 ao_color = fragment_payload.pbr_material->ao_map->getColor(u, v) * (1.0f / 255.0f);
-		float ao = (ao_color.x() + ao_color.y() + ao_color.z()) / 3.0f;
-		ambient *= ao;
-	}
+	ambient *= ao;
 	
 	Vec3 color = ambient + result_color;
 	color = color.cwiseQuotient(color + Vec3(1.0f, 1.0f, 1.0f));
-	color = Vec3(pow(color.x(), 1.0f/2.2f), pow(color.y(), 1.0f/2.2f), pow(color.z(), 1.0f/2.2f));
+	if constexpr (fast)
+		color = Vec3(gammaEncodeFast(color.x()), gammaEncodeFast(color.y()), gammaEncodeFast(color.z()));
+	else
+		color = Vec3(pow(color.x(), 1.0f/2.2f), pow(color.y(), 1.0f/2.2f), pow(color.z(), 1.0f/2.2f));
 	
 	return color;
 }
+
+template <unsigned FEATURES>
+Vec3 Shader::pbrKernelFor(const Shader& shader, const FragmentPayload& fragment_payload, const vector<Light>& lights, const Skybox* skybox) {
+	return shader.pbrShading<FEATURES>(fragment_payload, lights, skybox);
+}
+
+unsigned Shader::pbrFeatures(const PBRMaterial* material, const Skybox* skybox) const {
+	unsigned features = 0;
+	if (material) {
+		features |= PBR_MATERIAL;
+		if (material->hasAlbedoMap())
+			features |= PBR_ALBEDO_MAP;
+		if (material->hasORMMap())
+			features |= PBR_ORM_MAP;
+		if (material->hasNormalMap())
+			features |= PBR_NORMAL_MAP;
+	}
+	if (skybox && skybox->isLoaded())
+		features |= PBR_SKYBOX;
+	if (pbr_math == PBRMath::Fast)
+		features |= PBR_FAST_MATH;
+	return features;
+}
+
+Shader::PBRKernel Shader::pbrKernel(const PBRMaterial* material, const Skybox* skybox) const {
+	static const array<PBRKernel, PBR_VARIANTS> kernels = []<size_t... VARIANTS>(index_sequence<VARIANTS...>) {
+		return array<PBRKernel, PBR_VARIANTS>{ &Shader::pbrKernelFor<VARIANTS>... };
+	}(make_index_sequence<PBR_VARIANTS>());
+	return kernels[pbrFeatures(material, skybox)];
+}
+
+template <unsigned FEATURES>
+void Shader::pbrShadingBatch(const FragmentBatch& fragments, const LightList& lights, const Skybox* skybox, Vec3* colors) const {
+	const int N = BATCH_SIZE;
+	constexpr bool fast = (FEATURES & PBR_FAST_MATH) != 0;
+
+	// lanes past count repeat lane 0, so every lane goes through the same vector code and a fragment's
+	// color does not depend on its position in the batch
+	int lane[N];
+	for (int i = 0; i < N; i++)
+		lane[i] = i < fragments.count ? i : 0;
+
+	float normal_x[N], normal_y[N], normal_z[N], albedo_r[N], albedo_g[N], albedo_b[N];
+	float metallic[N], roughness[N], ao[N];
+	for (int i = 0; i < N; i++) {
+		int k = lane[i];
+		float x = fragments.normal_x[k], y = fragments.normal_y[k], z = fragments.normal_z[k];
+		float normal_len = sqrt(x * x + y * y + z * z);
+		bool valid = normal_len > 1e-6f;
+		normal_x[i] = valid ? x / normal_len : 0.0f;
+		normal_y[i] = valid ? y / normal_len : 0.0f;
+		normal_z[i] = valid ? z / normal_len : 1.0f;
+		albedo_r[i] = fragments.color_r[k];
+		albedo_g[i] = fragments.color_g[k];
+		albedo_b[i] = fragments.color_b[k];
+		metallic[i] = 0.0f;
+		roughness[i] = 0.5f;
+		ao[i] = 1.0f;
+	}
+
+	// texture fetches are gathers, one lane at a time
+	if constexpr ((FEATURES & PBR_MATERIAL) != 0) {
+		const PBRMaterial& material = *fragments.pbr_material;
+		for (int i = 0; i < N; i++) {
+			int k = lane[i];
+			float u = std::clamp(fragments.u[k], 0.0f, 1.0f);
+			float v = std::clamp(fragments.v[k], 0.0f, 1.0f);
+			Vec2 dx(fragments.du_dx[k], fragments.dv_dx[k]), dy(fragments.du_dy[k], fragments.dv_dy[k]);
+
+			Vec3 albedo = material.albedo;
+			if constexpr ((FEATURES & PBR_ALBEDO_MAP) != 0)
+				albedo = sampleTexture(*material.albedo_map, dx, dy, u, v);
+			albedo_r[i] = albedo.x();
+			albedo_g[i] = albedo.y();
+			albedo_b[i] = albedo.z();
+
+			if constexpr ((FEATURES & PBR_ORM_MAP) != 0) {
+				Vec3 orm = sampleTexture(*material.orm_map, dx, dy, u, v);
+				ao[i] = orm.x();
+				roughness[i] = orm.y();
+				metallic[i] = orm.z();
+			}
+			else {
+				metallic[i] = material.hasMetallicMap() ? sampleTexture(*material.metallic_map, dx, dy, u, v).x() : material.metallic;
+				roughness[i] = material.hasRoughnessMap() ? sampleTexture(*material.roughness_map, dx, dy, u, v).x() : material.roughness;
+				if (material.hasAOMap())
+					ao[i] = sampleTexture(*material.ao_map, dx, dy, u, v).x();
+			}
+
+			if constexpr ((FEATURES & PBR_NORMAL_MAP) != 0) {
+				Vec3 normal(normal_x[i], normal_y[i], normal_z[i]);
+				Vec3 normal_color = sampleTexture(*material.normal_map, dx, dy, u, v);
+				Vec3 tangent_normal = normal_color * 2.0f - Vec3(1.0f, 1.0f, 1.0f);
+				Vec3 new_normal_vec = normal + tangent_normal * 0.5f;
+				float new_normal_len = new_normal_vec.norm();
+				if (new_normal_len > 1e-6f) {
+					normal_x[i] = new_normal_vec.x() / new_normal_len;
+					normal_y[i] = new_normal_vec.y() / new_normal_len;
+					normal_z[i] = new_normal_vec.z() / new_normal_len;
+				}
+			}
+		}
+	}
+
+	float view_x[N], view_y[N], view_z[N], f0_r[N], f0_g[N], f0_b[N];
+	float result_r[N], result_g[N], result_b[N];
+	for (int i = 0; i < N; i++) {
+		int k = lane[i];
+		float x = eye_pos.x() - fragments.pos_x[k], y = eye_pos.y() - fragments.pos_y[k], z = eye_pos.z() - fragments.pos_z[k];
+		float view_dir_len = sqrt(x * x + y * y + z * z);
+		bool valid = view_dir_len > 1e-6f;
+		view_x[i] = valid ? x / view_dir_len : 0.0f;
+		view_y[i] = valid ? y / view_dir_len : 0.0f;
+		view_z[i] = valid ? z / view_dir_len : 1.0f;
+		f0_r[i] = 0.04f * (1.0f - metallic[i]) + albedo_r[i] * metallic[i];
+		f0_g[i] = 0.04f * (1.0f - metallic[i]) + albedo_g[i] * metallic[i];
+		f0_b[i] = 0.04f * (1.0f - metallic[i]) + albedo_b[i] * metallic[i];
+		result_r[i] = result_g[i] = result_b[i] = 0.0f;
+	}
+
+	// direct lighting, every light once for all lanes. A light whose radius ends before the bounding box
+	// of the batch adds exactly 0 to every lane and is skipped; the margin covers the rounding of distances
+	float box_min[3] = { fragments.pos_x[0], fragments.pos_y[0], fragments.pos_z[0] };
+	float box_max[3] = { box_min[0], box_min[1], box_min[2] };
+	for (int i = 1; i < fragments.count; i++) {
+		const float pos[3] = { fragments.pos_x[i], fragments.pos_y[i], fragments.pos_z[i] };
+		for (int c = 0; c < 3; c++) {
+			box_min[c] = min(box_min[c], pos[c]);
+			box_max[c] = max(box_max[c], pos[c]);
+		}
+	}
+	auto out_of_reach = [&](int l) {
+		const float light_pos[3] = { lights.pos_x[l], lights.pos_y[l], lights.pos_z[l] };
+		float distance_squared = 0.0f;
+		for (int c = 0; c < 3; c++) {
+			float d = max({ box_min[c] - light_pos[c], light_pos[c] - box_max[c], 0.0f });
+			distance_squared += d * d;
+		}
+		return distance_squared > lights.radius_squared[l] * 1.0001f;
+	};
+
+	if constexpr (fast) {
+		float a_squared[N], k[N], specular_scale[N], diffuse_r[N], diffuse_g[N], diffuse_b[N];
+		for (int i = 0; i < N; i++) {
+			float r = roughness[i];
+			a_squared[i] = r * r * r * r;
+			k[i] = (r + 1.0f) * (r + 1.0f) / 8.0f;
+			float n_dot_v = max(normal_x[i] * view_x[i] + normal_y[i] * view_y[i] + normal_z[i] * view_z[i], 0.0f);
+			specular_scale[i] = n_dot_v > 0.0f ? 1.0f / ((float)(4.0 * PI) * (n_dot_v * (1.0f - k[i]) + k[i])) : 0.0f;
+			diffuse_r[i] = albedo_r[i] * (1.0f - metallic[i]) / (float)PI;
+			diffuse_g[i] = albedo_g[i] * (1.0f - metallic[i]) / (float)PI;
+			diffuse_b[i] = albedo_b[i] * (1.0f - metallic[i]) / (float)PI;
+		}
+		for (int l = 0; l < lights.size(); l++) {
+			if (out_of_reach(l))
+				continue;
+			float light_x = lights.pos_x[l], light_y = lights.pos_y[l], light_z = lights.pos_z[l];
+			float intensity_r = lights.intensity_r[l], intensity_g = lights.intensity_g[l], intensity_b = lights.intensity_b[l];
+			float radius_squared = lights.radius_squared[l];
+			for (int i = 0; i < N; i++) {
+				int j = lane[i];
+				float lx = light_x - fragments.pos_x[j], ly = light_y - fragments.pos_y[j], lz = light_z - fragments.pos_z[j];
+				float distance_squared = lx * lx + ly * ly + lz * lz;
+				float n_dot_l_len = normal_x[i] * lx + normal_y[i] * ly + normal_z[i] * lz;
+				bool lit = n_dot_l_len > 0.0f && distance_squared >= 1e-12f;
+				float inv_distance = lit ? 1.0f / sqrt(distance_squared) : 0.0f; // a light on the fragment would give inf * 0 = NaN
+				lx *= inv_distance;
+				ly *= inv_distance;
+				lz *= inv_distance;
+				float n_dot_l = n_dot_l_len * inv_distance;
+				float hx = view_x[i] + lx, hy = view_y[i] + ly, hz = view_z[i] + lz;
+				float half_dir_len_squared = hx * hx + hy * hy + hz * hz;
+				bool valid = half_dir_len_squared > 1e-12f;
+				float inv_half_len = 1.0f / sqrt(half_dir_len_squared);
+				hx = valid ? hx * inv_half_len : 0.0f;
+				hy = valid ? hy * inv_half_len : 0.0f;
+				hz = valid ? hz * inv_half_len : 1.0f;
+
+				float n_dot_h = max(normal_x[i] * hx + normal_y[i] * hy + normal_z[i] * hz, 0.0f);
+				float x = 1.0f - std::clamp(hx * view_x[i] + hy * view_y[i] + hz * view_z[i], 0.0f, 1.0f);
+				float x_squared = x * x;
+				float x_5 = x_squared * x_squared * x;
+				float fresnel_r = f0_r[i] + (1.0f - f0_r[i]) * x_5;
+				float fresnel_g = f0_g[i] + (1.0f - f0_g[i]) * x_5;
+				float fresnel_b = f0_b[i] + (1.0f - f0_b[i]) * x_5;
+				float d = n_dot_h * n_dot_h * (a_squared[i] - 1.0f) + 1.0f;
+				float g_l = n_dot_l * (1.0f - k[i]) + k[i];
+				float specular = a_squared[i] * specular_scale[i] / max(d * d * g_l, 0.0000001f);
+
+				// selected rather than weighted by 0, so an unlit light never adds anything, as the scalar kernel skips it
+				float weight = n_dot_l * lightWindow(distance_squared, radius_squared) / distance_squared;
+				result_r[i] += lit ? ((1.0f - fresnel_r) * diffuse_r[i] + fresnel_r * specular) * intensity_r * weight : 0.0f;
+				result_g[i] += lit ? ((1.0f - fresnel_g) * diffuse_g[i] + fresnel_g * specular) * intensity_g * weight : 0.0f;
+				result_b[i] += lit ? ((1.0f - fresnel_b) * diffuse_b[i] + fresnel_b * specular) * intensity_b * weight : 0.0f;
+			}
+		}
+	}
+	else {
+		for (int l = 0; l < lights.size(); l++) {
+			if (out_of_reach(l))
+				continue;
+			float light_x = lights.pos_x[l], light_y = lights.pos_y[l], light_z = lights.pos_z[l];
+			float intensity_r = lights.intensity_r[l], intensity_g = lights.intensity_g[l], intensity_b = lights.intensity_b[l];
+			float radius_squared = lights.radius_squared[l];
+			for (int i = 0; i < N; i++) {
+				int j = lane[i];
+				float lx = light_x - fragments.pos_x[j], ly = light_y - fragments.pos_y[j], lz = light_z - fragments.pos_z[j];
+				float light_dir_len = sqrt(lx * lx + ly * ly + lz * lz);
+				bool valid = light_dir_len > 1e-6f;
+				float attenuation = lightWindow(light_dir_len * light_dir_len, radius_squared) / (light_dir_len * light_dir_len);
+				lx = valid ? lx / light_dir_len : 0.0f;
+				ly = valid ? ly / light_dir_len : 0.0f;
+				lz = valid ? lz / light_dir_len : 1.0f;
+				float hx = view_x[i] + lx, hy = view_y[i] + ly, hz = view_z[i] + lz;
+				float half_dir_len = sqrt(hx * hx + hy * hy + hz * hz);
+				valid = half_dir_len > 1e-6f;
+				hx = valid ? hx / half_dir_len : 0.0f;
+				hy = valid ? hy / half_dir_len : 0.0f;
+				hz = valid ? hz / half_dir_len : 1.0f;
+
+				// Cook-Torrance BRDF, the same terms as distributionGGX, geometrySmith and fresnelSchlick
+				float a = roughness[i] * roughness[i];
+				float a_squared = a * a;
+				float n_dot_h = max(normal_x[i] * hx + normal_y[i] * hy + normal_z[i] * hz, 0.0f);
+				float denom = n_dot_h * n_dot_h * (a_squared - 1.0f) + 1.0f;
+				denom = PI * denom * denom;
+				float ndf = a_squared / max(denom, 0.0000001f);
+
+				float n_dot_v = max(normal_x[i] * view_x[i] + normal_y[i] * view_y[i] + normal_z[i] * view_z[i], 0.0f);
+				float n_dot_l = max(normal_x[i] * lx + normal_y[i] * ly + normal_z[i] * lz, 0.0f);
+				float r = roughness[i] + 1.0f;
+				float k = (r * r) / 8.0f;
+				float geometry = n_dot_l / max(n_dot_l * (1.0f - k) + k, 0.0000001f) * (n_dot_v / max(n_dot_v * (1.0f - k) + k, 0.0000001f));
+
+				float x_5 = pow(std::clamp(1.0f - max(hx * view_x[i] + hy * view_y[i] + hz * view_z[i], 0.0f), 0.0f, 1.0f), 5.0f);
+				float fresnel_r = f0_r[i] + (1.0f - f0_r[i]) * x_5;
+				float fresnel_g = f0_g[i] + (1.0f - f0_g[i]) * x_5;
+				float fresnel_b = f0_b[i] + (1.0f - f0_b[i]) * x_5;
+
+				float ndf_geometry = ndf * geometry;
+				float denominator = 4.0f * n_dot_v * n_dot_l + 0.0001f;
+				result_r[i] += ((1.0f - fresnel_r) * (1.0f - metallic[i]) * albedo_r[i] / (float)PI + ndf_geometry * fresnel_r / denominator) * (intensity_r * attenuation) * n_dot_l;
+				result_g[i] += ((1.0f - fresnel_g) * (1.0f - metallic[i]) * albedo_g[i] / (float)PI + ndf_geometry * fresnel_g / denominator) * (intensity_g * attenuation) * n_dot_l;
+				result_b[i] += ((1.0f - fresnel_b) * (1.0f - metallic[i]) * albedo_b[i] / (float)PI + ndf_geometry * fresnel_b / denominator) * (intensity_b * attenuation) * n_dot_l;
+			}
+		}
+	}
+
+	// image based ambient light, tone mapping and gamma, lane by lane
+	for (int i = 0; i < fragments.count; i++) {
+		Vec3 normal(normal_x[i], normal_y[i], normal_z[i]);
+		Vec3 view_dir(view_x[i], view_y[i], view_z[i]);
+		Vec3 albedo(albedo_r[i], albedo_g[i], albedo_b[i]);
+		Vec3 fresnel(f0_r[i], f0_g[i], f0_b[i]);
+		Vec3 ambient;
+		if constexpr ((FEATURES & PBR_SKYBOX) != 0) {
+			float n_dot_v = max(normal.dot(view_dir), 0.0f);
+			Vec3 k_s = fresnelSchlickRoughness(n_dot_v, fresnel, roughness[i]);
+			Vec3 k_d = (Vec3(1.0f, 1.0f, 1.0f) - k_s) * (1.0f - metallic[i]);
+			Vec3 reflect_dir = normal * (2.0f * normal.dot(view_dir)) - view_dir;
+			Vec2 env_brdf = skybox->getEnvironmentBRDF(n_dot_v, roughness[i]);
+			Vec3 specular = skybox->getSpecular(reflect_dir, roughness[i]).cwiseProduct(fresnel * env_brdf.x() + Vec3(env_brdf.y(), env_brdf.y(), env_brdf.y()));
+			ambient = k_d.cwiseProduct(skybox->getIrradiance(normal)).cwiseProduct(albedo) + specular;
+		}
+		else {
+			ambient = Vec3(0.03f, 0.03f, 0.03f).cwiseProduct(albedo);
+		}
+		ambient *= ao[i];
+
+		Vec3 color = ambient + Vec3(result_r[i], result_g[i], result_b[i]);
+		color = color.cwiseQuotient(color + Vec3(1.0f, 1.0f, 1.0f));
+		if constexpr (fast)
+			colors[i] = Vec3(gammaEncodeFast(color.x()), gammaEncodeFast(color.y()), gammaEncodeFast(color.z()));
+		else
+			colors[i] = Vec3(pow(color.x(), 1.0f/2.2f), pow(color.y(), 1.0f/2.2f), pow(color.z(), 1.0f/2.2f));
+	}
+}
+
+template <unsigned FEATURES>
+void Shader::pbrBatchKernelFor(const Shader& shader, const FragmentBatch& batch, const LightList& lights, const Skybox* skybox, Vec3* colors) {
+	shader.pbrShadingBatch<FEATURES>(batch, lights, skybox, colors);
+}
+
+Shader::PBRBatchKernel Shader::pbrBatchKernel(const PBRMaterial* material, const Skybox* skybox) const {
+	static const array<PBRBatchKernel, PBR_VARIANTS> kernels = []<size_t... VARIANTS>(index_sequence<VARIANTS...>) {
+		return array<PBRBatchKernel, PBR_VARIANTS>{ &Shader::pbrBatchKernelFor<VARIANTS>... };
+	}(make_index_sequence<PBR_VARIANTS>());
+	return kernels[pbrFeatures(material, skybox)];
+}
+
+Vec3 Shader::pbrShader(const FragmentPayload& fragment_payload, const vector<Light>& lights, const Skybox* skybox) {
+	return pbrKernel(fragment_payload.pbr_material, skybox)(*this, fragment_payload, lights, skybox);
+}
@@ -4,6 +4,9 @@
 #include "texture.hpp"
 #include "material.hpp"
 #include <Eigen/Eigen>
+#include <algorithm>
+#include <limits>
+#include <vector>
 
 using namespace std;
 using Vec2 = Eigen::Vector2f;
@@ -17,6 +20,10 @@ class Shader {
 public:
 	Shader(); // presets
 
+	// Exact: reference Cook-Torrance terms and pow() gamma; Fast: GGX and Smith fused into one
+	// reciprocal, Fresnel powers by multiplication and a table based gamma encode
+	enum class PBRMath { Exact, Fast };
+
 	struct VertexPayload { // store vertex information
 		Vec3 pos;
 	};
@@ -25,13 +32,16 @@ public:
 		FragmentPayload() {
 			texture = nullptr;
 			pbr_material = nullptr;
+			text_coord_dx = text_coord_dy = Vec2(0, 0);
 		}
 
 		FragmentPayload(const Vec3& p, const Vec3& c, const Vec2& t_c, const Vec3& n, Texture* t) :
-			pos(p), normal(n), color(c), text_coord(t_c), texture(t), pbr_material(nullptr) {}
+			pos(p), normal(n), color(c), text_coord(t_c), texture(t), pbr_material(nullptr),
+			text_coord_dx(0, 0), text_coord_dy(0, 0) {}
 		
 		FragmentPayload(const Vec3& p, const Vec3& c, const Vec2& t_c, const Vec3& n, Texture* t, PBRMaterial* pbr) :
-			pos(p), normal(n), color(c), text_coord(t_c), texture(t), pbr_material(pbr) {}
+			pos(p), normal(n), color(c), text_coord(t_c), texture(t), pbr_material(pbr),
+			text_coord_dx(0, 0), text_coord_dy(0, 0) {}
 	
 		Vec3 pos; //view position
 		Vec3 color;
@@ -39,14 +49,77 @@ public:
 		Vec3 normal;
 		Texture* texture;
 		PBRMaterial* pbr_material;
+		Vec2 text_coord_dx; // change of text_coord from one pixel to the next in x and y, selects the mip level
+		Vec2 text_coord_dy;
+	};
+
+	static const int BATCH_SIZE = 8; // fragments shaded together by the batch kernels, one raster span
+
+	struct FragmentBatch { // up to BATCH_SIZE fragments of one draw, one array per attribute component
+		int count;
+		float pos_x[BATCH_SIZE], pos_y[BATCH_SIZE], pos_z[BATCH_SIZE];
+		float normal_x[BATCH_SIZE], normal_y[BATCH_SIZE], normal_z[BATCH_SIZE];
+		float color_r[BATCH_SIZE], color_g[BATCH_SIZE], color_b[BATCH_SIZE];
+		float u[BATCH_SIZE], v[BATCH_SIZE];
+		float du_dx[BATCH_SIZE], dv_dx[BATCH_SIZE], du_dy[BATCH_SIZE], dv_dy[BATCH_SIZE];
+		PBRMaterial* pbr_material;
+
+		void set(int i, const FragmentPayload& f) {
+			pos_x[i] = f.pos.x(); pos_y[i] = f.pos.y(); pos_z[i] = f.pos.z();
+			normal_x[i] = f.normal.x(); normal_y[i] = f.normal.y(); normal_z[i] = f.normal.z();
+			color_r[i] = f.color.x(); color_g[i] = f.color.y(); color_b[i] = f.color.z();
+			u[i] = f.text_coord.x(); v[i] = f.text_coord.y();
+			du_dx[i] = f.text_coord_dx.x(); dv_dx[i] = f.text_coord_dx.y();
+			du_dy[i] = f.text_coord_dy.x(); dv_dy[i] = f.text_coord_dy.y();
+		}
 	};
 
 	struct Light {
 		Light(const Vec3& p, const Vec3& i) :
-			pos(p), intensity(i) {}
+			pos(p), intensity(i), radius(numeric_limits<float>::infinity()) {}
+
+		Light(const Vec3& p, const Vec3& i, float r) :
+			pos(p), intensity(i), radius(r) {}
 
 		Vec3 pos;
 		Vec3 intensity;
+		float radius; // the light reaches no fragment farther away, infinity: unbounded
+
+		// factor on the inverse square falloff that fades it to 0 at radius, 1 for an unbounded light
+		float window(float distance_squared) const {
+			float x = distance_squared / (radius * radius);
+			float w = std::clamp(1.0f - x * x, 0.0f, 1.0f);
+			return w * w;
+		}
+	};
+
+	struct LightList { // lights with one array per component, read by the batch kernels
+		vector<float> pos_x, pos_y, pos_z;
+		vector<float> intensity_r, intensity_g, intensity_b;
+		vector<float> radius_squared;
+		vector<Light> lights; // the same lights for the per-fragment shaders
+
+		LightList() {}
+		LightList(const vector<Light>& l) {
+			for (const Light& light : l)
+				add(light);
+		}
+
+		void add(const LightList& list, int i) { // copy light i of list with its precomputed values
+			pos_x.push_back(list.pos_x[i]); pos_y.push_back(list.pos_y[i]); pos_z.push_back(list.pos_z[i]);
+			intensity_r.push_back(list.intensity_r[i]); intensity_g.push_back(list.intensity_g[i]); intensity_b.push_back(list.intensity_b[i]);
+			radius_squared.push_back(list.radius_squared[i]);
+			lights.push_back(list.lights[i]);
+		}
+
+		void add(const Light& light) {
+			pos_x.push_back(light.pos.x()); pos_y.push_back(light.pos.y()); pos_z.push_back(light.pos.z());
+			intensity_r.push_back(light.intensity.x()); intensity_g.push_back(light.intensity.y()); intensity_b.push_back(light.intensity.z());
+			radius_squared.push_back(light.radius * light.radius);
+			lights.push_back(light);
+		}
+
+		int size() const { return (int)lights.size(); }
 	};
 
 	Vec3 vertexShader(const VertexPayload& vertex_payload);
@@ -55,16 +128,43 @@ public:
 	Vec3 normalShader(const FragmentPayload& fragment_payload, const vector<Light>& lights);  // normal mapping
 	Vec3 pbrShader(const FragmentPayload& fragment_payload, const vector<Light>& lights, const class Skybox* skybox = nullptr);     // PBR shader (Cook-Torrance BRDF)
 
+	void setPBRMath(PBRMath math);
+	PBRMath getPBRMath() const;
+
+	// pbrShader compiled for one feature set: which maps the material has, whether the skybox lights
+	// the scene and the PBR math. The feature branches are resolved at compile time, so picking the
+	// kernel once per draw saves them on every fragment; pbrShader picks it per call
+	using PBRKernel = Vec3 (*)(const Shader& shader, const FragmentPayload& fragment_payload, const vector<Light>& lights, const class Skybox* skybox);
+	PBRKernel pbrKernel(const PBRMaterial* material, const class Skybox* skybox) const;
+
+	// the same shading for a batch of fragments, written lane by lane over fixed size arrays so the
+	// lighting math vectorizes across the fragments; colors receives batch.count results.
+	// pbrShader and pbrKernel stay the scalar reference
+	using PBRBatchKernel = void (*)(const Shader& shader, const FragmentBatch& batch, const LightList& lights, const class Skybox* skybox, Vec3* colors);
+	PBRBatchKernel pbrBatchKernel(const PBRMaterial* material, const class Skybox* skybox) const;
+
 private:
 	Vec3 ks, kd, ka;
 	Vec3 ia; // ambient intensity
 	float kh, kn;
 	Vec3 eye_pos;
+	PBRMath pbr_math;
 	
-	float distributionGGX(const Vec3& normal, const Vec3& half_dir, float roughness);
-	float geometrySchlickGGX(float n_dot_v, float roughness);
-	float geometrySmith(const Vec3& N, const Vec3& V, const Vec3& L, float roughness);
-	Vec3 fresnelSchlick(float cos_theta, const Vec3& F0);
+	float distributionGGX(const Vec3& normal, const Vec3& half_dir, float roughness) const;
+	float geometrySchlickGGX(float n_dot_v, float roughness) const;
+	float geometrySmith(const Vec3& N, const Vec3& V, const Vec3& L, float roughness) const;
+	Vec3 fresnelSchlick(float cos_theta, const Vec3& F0) const;
+	Vec3 fresnelSchlickRoughness(float cos_theta, const Vec3& F0, float roughness) const; // Fresnel averaged over the lobe, for image based lighting
+
+	template <unsigned FEATURES>
+	Vec3 pbrShading(const FragmentPayload& fragment_payload, const vector<Light>& lights, const class Skybox* skybox) const;
+	template <unsigned FEATURES>
+	static Vec3 pbrKernelFor(const Shader& shader, const FragmentPayload& fragment_payload, const vector<Light>& lights, const class Skybox* skybox);
+	template <unsigned FEATURES>
+	void pbrShadingBatch(const FragmentBatch& batch, const LightList& lights, const class Skybox* skybox, Vec3* colors) const;
+	template <unsigned FEATURES>
+	static void pbrBatchKernelFor(const Shader& shader, const FragmentBatch& batch, const LightList& lights, const class Skybox* skybox, Vec3* colors);
+	unsigned pbrFeatures(const PBRMaterial* material, const class Skybox* skybox) const;
 };
 
 #endif
@@ -1,23 +1,330 @@
 #include "skybox.hpp"
+#include "thread_pool.hpp"
 #include <cmath>
 #include <algorithm>
+#include <filesystem>
+#include <fstream>
 
 const double PI = 3.14159265358979323846;
+const int AMBIENT_FACE_SIZE = 16;   // face size of the mip level used for ambient lookups
+const int SPECULAR_LEVELS = 6;      // prefiltered environments for roughness 0, 0.2, ..., 1
+const int SPECULAR_FACE_SIZE = 128; // face size of the roughness 0 level, halved per level
+const int SPECULAR_SAMPLES = 64;    // GGX samples per prefiltered texel
+const int BRDF_LUT_SIZE = 64;
+const int BRDF_SAMPLES = 512;
 
 using namespace std;
 
-Skybox::Skybox() {
+Skybox::Skybox() : ambient_lod(0.0f) {
+	irradiance_sh.fill(Vec3(0.0f, 0.0f, 0.0f));
+}
+
+// direction through face coordinates (s, t) in [-1, 1], s to the right and t down on the face
+static Vec3 faceDirection(int face, float s, float t) {
+	switch (face) {
+	case 0: return Vec3(1, -t, -s);
+	case 1: return Vec3(-1, -t, s);
+	case 2: return Vec3(s, 1, t);
+	case 3: return Vec3(s, -1, -t);
+	case 4: return Vec3(s, -t, 1);
+	default: return Vec3(-s, -t, -1);
+	}
+}
+
+// the caches live next to the image and are only used when they name the same image path and modification time
+static string cacheKey(const string& filename) {
+	error_code error;
+	auto mtime = filesystem::last_write_time(filename, error);
+	if (error)
+		return "";
+	return filename + " " + to_string((long long)mtime.time_since_epoch().count());
+}
+
+static bool loadIrradianceCache(const string& filename, array<Vec3, 9>& sh) {
+	ifstream file(filename + ".sh9");
+	string key;
+	if (!getline(file, key) || key.empty() || key != cacheKey(filename))
+		return false;
+	for (Vec3& c : sh)
+		if (!(file >> c.x() >> c.y() >> c.z()))
+			return false;
+	return true;
+}
+
+static void saveIrradianceCache(const string& filename, const array<Vec3, 9>& sh) {
+	string key = cacheKey(filename);
+	if (key.empty())
+		return;
+	ofstream file(filename + ".sh9");
+	file << key << "\n";
+	file.precision(9);
+	for (const Vec3& c : sh)
+		file << c.x() << " " << c.y() << " " << c.z() << "\n";
+}
+
+// Project the cube faces onto the 9 real spherical harmonics of bands 0 to 2, weighting every texel
+// by its solid angle. The coefficients are pre-multiplied by the basis constants and by the clamped
+// cosine convolution over PI, so evaluating the polynomials for a normal gives the irradiance over
+// PI, the ambient color of a white Lambertian surface
+static array<Vec3, 9> projectIrradiance(const vector<cv::Mat>& images, ThreadPool& pool) {
+	int size = images[0].rows;
+	vector<array<Eigen::Vector3d, 9>> row_sums(6 * size);
+	vector<double> row_weights(6 * size);
+	pool.parallelFor(6 * size, [&](int job) {
+		int face = job / size, y = job % size;
+		const cv::Vec3b* row = images[face].ptr<cv::Vec3b>(y);
+		array<Eigen::Vector3d, 9>& sum = row_sums[job];
+		sum.fill(Eigen::Vector3d::Zero());
+		double weight_sum = 0.0;
+		float t = (y + 0.5f) / size * 2.0f - 1.0f;
+		for (int x = 0; x < size; x++) {
+			float s = (x + 0.5f) / size * 2.0f - 1.0f;
+			float r2 = 1.0f + s * s + t * t;
+			double weight = 1.0 / (r2 * sqrt(r2)); // solid angle up to the constant texel area
+			Vec3 d = faceDirection(face, s, t) / sqrt(r2);
+			Eigen::Vector3d color = Eigen::Vector3d(row[x][0], row[x][1], row[x][2]) * (weight / 255.0);
+			double basis[9] = {
+				1.0, d.y(), d.z(), d.x(),
+				d.x() * d.y(), d.y() * d.z(), 3.0 * d.z() * d.z() - 1.0, d.x() * d.z(), d.x() * d.x() - d.y() * d.y()
+			};
+			for (int i = 0; i < 9; i++)
+				sum[i] += color * basis[i];
+			weight_sum += weight;
+		}
+		row_weights[job] = weight_sum;
+	});
+
+	// rows are summed in a fixed order so the result does not depend on the thread count
+	array<Eigen::Vector3d, 9> sum;
+	sum.fill(Eigen::Vector3d::Zero());
+	double weight_sum = 0.0;
+	for (int job = 0; job < 6 * size; job++) {
+		for (int i = 0; i < 9; i++)
+			sum[i] += row_sums[job][i];
+		weight_sum += row_weights[job];
+	}
+
+	// squared basis constants times the band's convolution factor (1, 2/3, 1/4), the weights sum to 4 PI
+	const double factor[9] = {
+		0.282095 * 0.282095,
+		0.488603 * 0.488603 * 2.0 / 3.0, 0.488603 * 0.488603 * 2.0 / 3.0, 0.488603 * 0.488603 * 2.0 / 3.0,
+		1.092548 * 1.092548 / 4.0, 1.092548 * 1.092548 / 4.0, 0.315392 * 0.315392 / 4.0, 1.092548 * 1.092548 / 4.0, 0.546274 * 0.546274 / 4.0
+	};
+	array<Vec3, 9> sh;
+	for (int i = 0; i < 9; i++) {
+		Eigen::Vector3d c = sum[i] * (4.0 * PI / weight_sum * factor[i]);
+		sh[i] = Vec3((float)c.x(), (float)c.y(), (float)c.z());
+	}
+	return sh;
+}
+
+// prefiltered environment levels and BRDF LUT, in binary: key, level count, per level the face size
+// and six RGB8 faces, then the LUT size and its (scale, bias) pairs
+static bool loadIBLCache(const string& filename, vector<vector<cv::Mat>>& levels, vector<Vec2>& lut) {
+	ifstream file(filename + ".ibl", ios::binary);
+	string key = cacheKey(filename);
+	int key_size = 0, level_count = 0, lut_size = 0;
+	if (!file.read((char*)&key_size, sizeof(int)) || key_size != (int)key.size() || key.empty())
+		return false;
+	string stored_key(key_size, ' ');
+	if (!file.read(&stored_key[0], key_size) || stored_key != key)
+		return false;
+	if (!file.read((char*)&level_count, sizeof(int)) || level_count != SPECULAR_LEVELS)
+		return false;
+	levels.assign(level_count, vector<cv::Mat>());
+	for (vector<cv::Mat>& level : levels) {
+		int size = 0;
+		if (!file.read((char*)&size, sizeof(int)) || size <= 0 || size > 4096)
+			return false;
+		for (int face = 0; face < 6; face++) {
+			level.push_back(cv::Mat(size, size, CV_8UC3));
+			for (int y = 0; y < size; y++)
+				if (!file.read((char*)level[face].ptr<uchar>(y), size * 3))
+					return false;
+		}
+	}
+	if (!file.read((char*)&lut_size, sizeof(int)) || lut_size != BRDF_LUT_SIZE)
+		return false;
+	lut.resize(lut_size * lut_size);
+	return (bool)file.read((char*)lut.data(), lut.size() * sizeof(Vec2));
+}
+
+static void saveIBLCache(const string& filename, const vector<vector<cv::Mat>>& levels, const vector<Vec2>& lut) {
+	string key = cacheKey(filename);
+	if (key.empty())
+		return;
+	ofstream file(filename + ".ibl", ios::binary);
+	int key_size = (int)key.size(), level_count = (int)levels.size(), lut_size = BRDF_LUT_SIZE;
+	file.write((const char*)&key_size, sizeof(int));
+	file.write(key.data(), key_size);
+	file.write((const char*)&level_count, sizeof(int));
+	for (const vector<cv::Mat>& level : levels) {
+		int size = level[0].rows;
+		file.write((const char*)&size, sizeof(int));
+		for (const cv::Mat& image : level)
+			for (int y = 0; y < size; y++)
+				file.write((const char*)image.ptr<uchar>(y), size * 3);
+	}
+	file.write((const char*)&lut_size, sizeof(int));
+	file.write((const char*)lut.data(), lut.size() * sizeof(Vec2));
+}
+
+// i-th of n points of the Hammersley sequence in [0, 1)^2
+static Vec2 hammersley(unsigned int i, unsigned int n) {
+	unsigned int bits = i;
+	bits = (bits << 16) | (bits >> 16);
+	bits = ((bits & 0x55555555u) << 1) | ((bits & 0xAAAAAAAAu) >> 1);
+	bits = ((bits & 0x33333333u) << 2) | ((bits & 0xCCCCCCCCu) >> 2);
+	bits = ((bits & 0x0F0F0F0Fu) << 4) | ((bits & 0xF0F0F0F0u) >> 4);
+	bits = ((bits & 0x00FF00FFu) << 8) | ((bits & 0xFF00FF00u) >> 8);
+	return Vec2((float)i / n, bits * 2.3283064365386963e-10f);
+}
+
+// half vector around normal n distributed like the GGX normal distribution of the roughness
+static Vec3 importanceSampleGGX(const Vec2& xi, const Vec3& n, float roughness) {
+	float a = roughness * roughness;
+	float phi = 2.0f * PI * xi.x();
+	float cos_theta = sqrt((1.0f - xi.y()) / (1.0f + (a * a - 1.0f) * xi.y()));
+	float sin_theta = sqrt(1.0f - cos_theta * cos_theta);
+	Vec3 up = fabs(n.z()) < 0.999f ? Vec3(0, 0, 1) : Vec3(1, 0, 0);
+	Vec3 tangent = up.cross(n).normalized();
+	Vec3 bitangent = n.cross(tangent);
+	return tangent * (cos(phi) * sin_theta) + bitangent * (sin(phi) * sin_theta) + n * cos_theta;
+}
+
+// split-sum scale and bias of F0 for the GGX specular lobe, rows by roughness and columns by n_dot_v
+static vector<Vec2> integrateBRDF(ThreadPool& pool) {
+	vector<Vec2> lut(BRDF_LUT_SIZE * BRDF_LUT_SIZE);
+	pool.parallelFor(BRDF_LUT_SIZE, [&lut](int y) {
+		float roughness = (y + 0.5f) / BRDF_LUT_SIZE;
+		float k = roughness * roughness / 2.0f; // Schlick-GGX k for image based lighting
+		for (int x = 0; x < BRDF_LUT_SIZE; x++) {
+			float n_dot_v = (x + 0.5f) / BRDF_LUT_SIZE;
+			Vec3 view_dir(sqrt(1.0f - n_dot_v * n_dot_v), 0.0f, n_dot_v);
+			float scale = 0.0f, bias = 0.0f;
+			for (int i = 0; i < BRDF_SAMPLES; i++) {
+				Vec3 half_dir = importanceSampleGGX(hammersley(i, BRDF_SAMPLES), Vec3(0, 0, 1), roughness);
+				float v_dot_h = view_dir.dot(half_dir);
+				Vec3 light_dir = half_dir * (2.0f * v_dot_h) - view_dir;
+				float n_dot_l = light_dir.z();
+				if (n_dot_l <= 0.0f)
+					continue;
+				float n_dot_h = max(half_dir.z(), 0.0f);
+				v_dot_h = max(v_dot_h, 0.0f);
+				float geometry = n_dot_v / (n_dot_v * (1.0f - k) + k) * n_dot_l / (n_dot_l * (1.0f - k) + k);
+				float visibility = geometry * v_dot_h / max(n_dot_h * n_dot_v, 1e-6f);
+				float fresnel = pow(1.0f - v_dot_h, 5.0f);
+				scale += (1.0f - fresnel) * visibility;
+				bias += fresnel * visibility;
+			}
+			lut[y * BRDF_LUT_SIZE + x] = Vec2(scale, bias) / (float)BRDF_SAMPLES;
+		}
+	});
+	return lut;
 }
 
 bool Skybox::loadFromFile(const string& filename) {
 	try {
-		texture = Texture(filename);
+		Texture panorama(filename);
+		ThreadPool pool;
+
+		// resample the panorama into six faces with about the same texel density, the
+		// atan2 / asin per texel is paid here once instead of on every lookup
+		int size = max(1, panorama.w() / 4);
+		vector<cv::Mat> images;
+		for (int face = 0; face < 6; face++)
+			images.push_back(cv::Mat(size, size, CV_8UC3));
+		pool.parallelFor(6 * size, [&](int job) {
+			int face = job / size, y = job % size;
+			cv::Vec3b* row = images[face].ptr<cv::Vec3b>(y);
+			for (int x = 0; x < size; x++) {
+				Vec3 dir = faceDirection(face, (x + 0.5f) / size * 2.0f - 1.0f, (y + 0.5f) / size * 2.0f - 1.0f);
+				Vec2 uv = directionToUV(dir);
+				Vec3 color = panorama.sample(uv.x(), uv.y(), 0.0f) * 255.0f;
+				row[x] = cv::Vec3b((uchar)lround(color.x()), (uchar)lround(color.y()), (uchar)lround(color.z()));
+			}
+		});
+
+		if (!loadIrradianceCache(filename, irradiance_sh)) {
+			irradiance_sh = projectIrradiance(images, pool);
+			saveIrradianceCache(filename, irradiance_sh);
+		}
+
+		vector<Texture> cube;
+		for (const cv::Mat& image : images)
+			cube.push_back(Texture(image));
+
+		vector<vector<cv::Mat>> levels;
+		vector<Vec2> lut;
+		if (!loadIBLCache(filename, levels, lut)) {
+			levels = prefilterSpecular(cube, pool);
+			lut = integrateBRDF(pool);
+			saveIBLCache(filename, levels, lut);
+		}
+		specular_faces.clear();
+		for (const vector<cv::Mat>& level : levels) {
+			specular_faces.push_back(vector<Texture>());
+			for (const cv::Mat& image : level)
+				specular_faces.back().push_back(Texture(image));
+		}
+		brdf_lut = lut;
+
+		faces = cube;
+		ambient_lod = log2(max(1.0f, (float)size / AMBIENT_FACE_SIZE));
 		return true;
 	} catch (...) {
 		return false;
 	}
 }
 
+vector<vector<cv::Mat>> Skybox::prefilterSpecular(const vector<Texture>& cube, ThreadPool& pool) const {
+	int source_size = cube[0].w();
+	float texel_angle = 4.0f * PI / (6.0f * source_size * source_size);
+	vector<vector<cv::Mat>> levels(SPECULAR_LEVELS);
+	for (int level = 0; level < SPECULAR_LEVELS; level++) {
+		float roughness = (float)level / (SPECULAR_LEVELS - 1);
+		int size = max(4, min(SPECULAR_FACE_SIZE, source_size) >> level);
+		for (int face = 0; face < 6; face++)
+			levels[level].push_back(cv::Mat(size, size, CV_8UC3));
+
+		// the GGX lobe around each texel direction, with normal = view = reflection direction; every sample
+		// reads the source mip level whose texels cover the solid angle of the sample to avoid noise
+		pool.parallelFor(6 * size, [&, level, size, roughness](int job) {
+			int face = job / size, y = job % size;
+			cv::Vec3b* row = levels[level][face].ptr<cv::Vec3b>(y);
+			for (int x = 0; x < size; x++) {
+				Vec3 n = faceDirection(face, (x + 0.5f) / size * 2.0f - 1.0f, (y + 0.5f) / size * 2.0f - 1.0f).normalized();
+				Vec3 color(0, 0, 0);
+				if (level == 0) {
+					color = sampleCube(cube, n, log2((float)source_size / size));
+				}
+				else {
+					float weight = 0.0f;
+					float a_squared = pow(roughness, 4.0f);
+					for (int i = 0; i < SPECULAR_SAMPLES; i++) {
+						Vec3 h = importanceSampleGGX(hammersley(i, SPECULAR_SAMPLES), n, roughness);
+						float n_dot_h = n.dot(h);
+						Vec3 l = h * (2.0f * n_dot_h) - n;
+						float n_dot_l = n.dot(l);
+						if (n_dot_l <= 0.0f)
+							continue;
+						float denom = n_dot_h * n_dot_h * (a_squared - 1.0f) + 1.0f;
+						float pdf = a_squared / (PI * denom * denom) / 4.0f;
+						float sample_angle = 1.0f / (SPECULAR_SAMPLES * pdf + 1e-4f);
+						float lod = max(0.5f * log2(sample_angle / texel_angle), 0.0f);
+						color += sampleCube(cube, l, lod) * n_dot_l;
+						weight += n_dot_l;
+					}
+					color /= max(weight, 1e-6f);
+				}
+				color *= 255.0f;
+				row[x] = cv::Vec3b((uchar)lround(color.x()), (uchar)lround(color.y()), (uchar)lround(color.z()));
+			}
+		});
+	}
+	return levels;
+}
+
 Vec2 Skybox::directionToUV(const Vec3& dir) const {
 	// Normalize direction safely
 	float dir_len = dir.norm();
@@ -38,12 +345,99 @@ Vec2 Skybox::directionToUV(const Vec3& dir) const {
 	return Vec2(u, v);
 }
 
+int Skybox::directionToFace(const Vec3& dir, float& u, float& v) const {
+	// the largest component picks the face, the other two divided by it are the face coordinates
+	float ax = fabs(dir.x()), ay = fabs(dir.y()), az = fabs(dir.z());
+	int face;
+	float major, s, t;
+	if (ax >= ay && ax >= az) {
+		face = dir.x() > 0 ? 0 : 1;
+		major = ax;
+		s = dir.x() > 0 ? -dir.z() : dir.z();
+		t = -dir.y();
+	}
+	else if (ay >= az) {
+		face = dir.y() > 0 ? 2 : 3;
+		major = ay;
+		s = dir.x();
+		t = dir.y() > 0 ? dir.z() : -dir.z();
+	}
+	else {
+		face = dir.z() > 0 ? 4 : 5;
+		major = az;
+		s = dir.z() > 0 ? dir.x() : -dir.x();
+		t = -dir.y();
+	}
+	if (major < 1e-6f) {
+		face = 4; // Default direction if invalid
+		major = 1.0f;
+		s = t = 0.0f;
+	}
+
+	// texture v points up, face t points down
+	float inv_major = 0.5f / major;
+	u = s * inv_major + 0.5f;
+	v = 0.5f - t * inv_major;
+	return face;
+}
+
+Vec3 Skybox::sampleCube(const vector<Texture>& cube, const Vec3& direction, float lod) const {
+	float u, v;
+	int face = directionToFace(direction, u, v);
+	return cube[face].sample(u, v, lod);
+}
+
 Vec3 Skybox::getColor(const Vec3& direction) const {
-	if (!texture.has_value()) {
+	if (faces.empty()) {
 		return Vec3(0.0f, 0.0f, 0.0f); // Default to black if not loaded
 	}
 	
-	Vec2 uv = directionToUV(direction);
-	return texture->getColor(uv.x(), uv.y()) * (1.0f / 255.0f);
+	return sampleCube(faces, direction, 0.0f);
+}
+
+Vec3 Skybox::getAmbientColor(const Vec3& direction) const {
+	if (faces.empty()) {
+		return Vec3(0.0f, 0.0f, 0.0f);
+	}
+
+	return sampleCube(faces, direction, ambient_lod);
 }
 
+Vec3 Skybox::getSpecular(const Vec3& direction, float roughness) const {
+	if (specular_faces.empty()) {
+		return Vec3(0.0f, 0.0f, 0.0f);
+	}
+
+	// blend the two prefiltered levels around the roughness, the face lookup is shared
+	float level = std::clamp(roughness, 0.0f, 1.0f) * (specular_faces.size() - 1);
+	int level_0 = min((int)level, (int)specular_faces.size() - 1);
+	float t = level - level_0;
+	float u, v;
+	int face = directionToFace(direction, u, v);
+	Vec3 color = specular_faces[level_0][face].sample(u, v, 0.0f);
+	if (t > 0.0f)
+		color = color * (1.0f - t) + specular_faces[level_0 + 1][face].sample(u, v, 0.0f) * t;
+	return color;
+}
+
+Vec2 Skybox::getEnvironmentBRDF(float n_dot_v, float roughness) const {
+	if (brdf_lut.empty()) {
+		return Vec2(1.0f, 0.0f);
+	}
+
+	// bilinear lookup, clamped to the texel centers at the borders
+	float fx = std::clamp(n_dot_v * BRDF_LUT_SIZE - 0.5f, 0.0f, BRDF_LUT_SIZE - 1.0f);
+	float fy = std::clamp(roughness * BRDF_LUT_SIZE - 0.5f, 0.0f, BRDF_LUT_SIZE - 1.0f);
+	int x0 = min((int)fx, BRDF_LUT_SIZE - 2), y0 = min((int)fy, BRDF_LUT_SIZE - 2);
+	float tx = fx - x0, ty = fy - y0;
+	const Vec2* row_0 = &brdf_lut[y0 * BRDF_LUT_SIZE + x0];
+	const Vec2* row_1 = row_0 + BRDF_LUT_SIZE;
+	return (row_0[0] * (1.0f - tx) + row_0[1] * tx) * (1.0f - ty) + (row_1[0] * (1.0f - tx) + row_1[1] * tx) * ty;
+}
+
+Vec3 Skybox::getIrradiance(const Vec3& normal) const {
+	const array<Vec3, 9>& sh = irradiance_sh;
+	float x = normal.x(), y = normal.y(), z = normal.z();
+	return sh[0] + sh[1] * y + sh[2] * z + sh[3] * x
+		+ sh[4] * (x * y) + sh[5] * (y * z) + sh[6] * (3.0f * z * z - 1.0f) + sh[7] * (x * z) + sh[8] * (x * x - y * y);
+}
@@ -4,7 +4,8 @@
 #include "texture.hpp"
 #include <Eigen/Eigen>
 #include <string>
-#include <optional>
+#include <vector>
+#include <array>
 
 using namespace std;
 using Vec2 = Eigen::Vector2f;
@@ -18,21 +19,38 @@ class Skybox {
 public:
 	Skybox();
 	
-	// Load skybox from a single equirectangular image
+	// Load skybox from a single equirectangular image, converted to a cubemap once. The spherical
+	// harmonic irradiance is cached in <filename>.sh9, the prefiltered specular environment and the
+	// BRDF LUT in <filename>.ibl, both are recomputed when the image changes
 	bool loadFromFile(const string& filename);
 	
-	// Get sky color for a given direction (normalized direction vector)
+	// Get sky color for a given direction (any length, it does not need to be normalized)
 	Vec3 getColor(const Vec3& direction) const;
+	// Blurred sky color from a low resolution level of the cubemap, for ambient lighting
+	Vec3 getAmbientColor(const Vec3& direction) const;
+	// Diffuse irradiance over PI around a normalized normal, from 9 spherical harmonic coefficients
+	Vec3 getIrradiance(const Vec3& normal) const;
+	// Split-sum specular image based lighting: the environment prefiltered with the GGX lobe of the
+	// roughness around the reflection direction, and the scale and bias of F0 from the BRDF LUT
+	Vec3 getSpecular(const Vec3& direction, float roughness) const;
+	Vec2 getEnvironmentBRDF(float n_dot_v, float roughness) const;
 	
 	// Check if skybox is loaded
-	bool isLoaded() const { return texture.has_value(); }
+	bool isLoaded() const { return !faces.empty(); }
 	
 private:
-	optional<Texture> texture;
+	vector<Texture> faces; // cubemap faces +X, -X, +Y, -Y, +Z, -Z
+	float ambient_lod;     // mip level of the faces used by getAmbientColor
+	array<Vec3, 9> irradiance_sh; // bands 0 to 2, pre-multiplied for getIrradiance
+	vector<vector<Texture>> specular_faces; // [level][face], level i prefiltered for roughness i / (levels - 1)
+	vector<Vec2> brdf_lut; // rows by roughness, columns by n_dot_v
 	
 	// Convert direction vector to equirectangular UV coordinates
 	Vec2 directionToUV(const Vec3& dir) const;
+	// Cube face the direction points at and the face texture coordinates
+	int directionToFace(const Vec3& dir, float& u, float& v) const;
+	Vec3 sampleCube(const vector<Texture>& cube, const Vec3& direction, float lod) const;
+	vector<vector<cv::Mat>> prefilterSpecular(const vector<Texture>& cube, class ThreadPool& pool) const;
 };
 
 #endif
-
@@ -2,12 +2,154 @@
 #include <Eigen/Eigen>
 #include <opencv2/opencv.hpp>
 #include <algorithm>
+#include <cstring>
+#include <cmath>
+#include <type_traits>
 
-Texture::Texture(const string& filename) {
-    image_data = cv::imread(filename);
+const int TEXTURE_TILE = 4; // side of the blocks in the tiled layout
+
+Texture::Texture(const string& filename, TextureFormat format, TextureLayout layout) :
+    texel_format(format), texel_layout(layout) {
+    cv::Mat image_data = cv::imread(filename);
     cv::cvtColor(image_data, image_data, cv::COLOR_RGB2BGR);
-    width = image_data.cols;
-    height = image_data.rows;
+    convert(image_data);
+    buildMipmaps();
+    selectLookups();
+}
+
+Texture::Texture(const cv::Mat& image, TextureFormat format, TextureLayout layout) :
+    texel_format(format), texel_layout(layout) {
+    convert(image);
+    buildMipmaps();
+    selectLookups();
+}
+
+// RGB 8-bit image to level 0 in the storage format, scalar maps keep the average of the three channels
+void Texture::convert(const cv::Mat& rgb) {
+    width = rgb.cols;
+    height = rgb.rows;
+
+    cv::Mat image;
+    switch (texel_format) {
+    case TextureFormat::R8:
+        image = cv::Mat(height, width, CV_8UC1);
+        for (int y = 0; y < height; y++) {
+            const cv::Vec3b* src = rgb.ptr<cv::Vec3b>(y);
+            uchar* dst = image.ptr<uchar>(y);
+            for (int x = 0; x < width; x++)
+                dst[x] = (uchar)((src[x][0] + src[x][1] + src[x][2] + 1) / 3);
+        }
+        break;
+    default:
+        image = cv::Mat(height, width, CV_8UC4);
+        for (int y = 0; y < height; y++) {
+            const cv::Vec3b* src = rgb.ptr<cv::Vec3b>(y);
+            cv::Vec4b* dst = image.ptr<cv::Vec4b>(y);
+            for (int x = 0; x < width; x++)
+                dst[x] = cv::Vec4b(src[x][0], src[x][1], src[x][2], 255);
+        }
+        if (texel_format == TextureFormat::RGBA32F)
+            image.convertTo(image, CV_32FC4, 1.0 / 255.0);
+        break;
+    }
+    mip_levels.push_back(MipLevel{ image, width, height });
+}
+
+// 2x2 box filter down to 1x1, INTER_AREA averages the source texels under each destination texel,
+// then every level is rearranged into the storage layout
+void Texture::buildMipmaps() {
+    while (mip_levels.back().width > 1 || mip_levels.back().height > 1) {
+        const cv::Mat& prev = mip_levels.back().texels;
+        cv::Mat next;
+        cv::resize(prev, next, cv::Size(max(1, prev.cols / 2), max(1, prev.rows / 2)), 0, 0, cv::INTER_AREA);
+        mip_levels.push_back(MipLevel{ next, next.cols, next.rows });
+    }
+
+    if (texel_layout != TextureLayout::Tiled)
+        return;
+    for (MipLevel& level : mip_levels) {
+        // texels of the padding repeat the edge, lookups never address them
+        int blocks_x = (level.width + TEXTURE_TILE - 1) / TEXTURE_TILE;
+        int blocks_y = (level.height + TEXTURE_TILE - 1) / TEXTURE_TILE;
+        size_t texel_size = level.texels.elemSize();
+        cv::Mat tiled(blocks_y, blocks_x * TEXTURE_TILE * TEXTURE_TILE, level.texels.type());
+        for (int y = 0; y < blocks_y * TEXTURE_TILE; y++)
+            for (int x = 0; x < blocks_x * TEXTURE_TILE; x++) {
+                int index = (x / TEXTURE_TILE * TEXTURE_TILE + y % TEXTURE_TILE) * TEXTURE_TILE + x % TEXTURE_TILE;
+                memcpy(tiled.ptr<uchar>(y / TEXTURE_TILE) + index * texel_size,
+                    level.texels.ptr<uchar>(min(y, level.height - 1)) + min(x, level.width - 1) * texel_size, texel_size);
+            }
+        level.texels = tiled;
+    }
+}
+
+// Texel access for a storage type T with C channels per texel in the given layout,
+// 8-bit values are mapped to [0, 1]
+template<typename T, int C, bool TILED>
+static const T* texelPtr(const Texture::MipLevel& level, int x, int y) {
+    if (TILED)
+        return level.texels.ptr<T>(y / TEXTURE_TILE)
+            + ((x / TEXTURE_TILE * TEXTURE_TILE + y % TEXTURE_TILE) * TEXTURE_TILE + x % TEXTURE_TILE) * C;
+    return level.texels.ptr<T>(y) + x * C;
+}
+
+template<typename T, int C, bool TILED>
+static Vec3 texelAt(const Texture::MipLevel& level, int x, int y) {
+    const float scale = is_same<T, float>::value ? 1.0f : 1.0f / 255.0f;
+    const T* texel = texelPtr<T, C, TILED>(level, x, y);
+    if (C == 1)
+        return Vec3::Constant(texel[0] * scale);
+    return Vec3(texel[0], texel[1], texel[2]) * scale;
+}
+
+template<typename T, int C, bool TILED>
+static Vec3 bilinearAt(const Texture::MipLevel& level, float u, float v) {
+    const float scale = is_same<T, float>::value ? 1.0f : 1.0f / 255.0f;
+
+    // texel centers sit at half-integer coordinates, texels outside the image are clamped to the edge
+    float x = u * level.width - 0.5f;
+    float y = (1.0f - v) * level.height - 0.5f;
+    int x0 = (int)floor(x), y0 = (int)floor(y);
+    float fx = x - x0, fy = y - y0;
+    int x1 = std::clamp(x0 + 1, 0, level.width - 1), y1 = std::clamp(y0 + 1, 0, level.height - 1);
+    x0 = std::clamp(x0, 0, level.width - 1);
+    y0 = std::clamp(y0, 0, level.height - 1);
+
+    const T* t00 = texelPtr<T, C, TILED>(level, x0, y0);
+    const T* t10 = texelPtr<T, C, TILED>(level, x1, y0);
+    const T* t01 = texelPtr<T, C, TILED>(level, x0, y1);
+    const T* t11 = texelPtr<T, C, TILED>(level, x1, y1);
+    float result[3];
+    for (int c = 0; c < (C == 1 ? 1 : 3); c++) {
+        float top = t00[c] + ((float)t10[c] - t00[c]) * fx;
+        float bottom = t01[c] + ((float)t11[c] - t01[c]) * fx;
+        result[c] = (top + (bottom - top) * fy) * scale;
+    }
+    if (C == 1)
+        return Vec3::Constant(result[0]);
+    return Vec3(result[0], result[1], result[2]);
+}
+
+template<typename T, int C>
+static void lookupsFor(bool tiled, Vec3 (*&texel_fn)(const Texture::MipLevel&, int, int),
+    Vec3 (*&bilinear_fn)(const Texture::MipLevel&, float, float)) {
+    texel_fn = tiled ? texelAt<T, C, true> : texelAt<T, C, false>;
+    bilinear_fn = tiled ? bilinearAt<T, C, true> : bilinearAt<T, C, false>;
+}
+
+void Texture::selectLookups() {
+    bool tiled = texel_layout == TextureLayout::Tiled;
+    switch (texel_format) {
+    case TextureFormat::RGBA32F:
+        lookupsFor<float, 4>(tiled, texel_fn, bilinear_fn);
+        break;
+    case TextureFormat::R8:
+        lookupsFor<uchar, 1>(tiled, texel_fn, bilinear_fn);
+        break;
+    default:
+        lookupsFor<uchar, 4>(tiled, texel_fn, bilinear_fn);
+        break;
+    }
 }
 
 Vec3 Texture::getColor(float u, float v) const {
@@ -22,8 +164,33 @@ Vec3 Texture::getColor(float u, float v) const {
     u_img = std::clamp(u_img, 0, width - 1);
     v_img = std::clamp(v_img, 0, height - 1);
     
-    auto color = image_data.at<cv::Vec3b>(v_img, u_img);
-    return Vec3(color[0], color[1], color[2]);
+    return texel_fn(mip_levels[0], u_img, v_img);
+}
+
+float Texture::lod(const Vec2& dx, const Vec2& dy) const {
+    // footprint of the pixel in level 0 texels, the longer axis picks the level
+    float rho_x = Vec2(dx.x() * width, dx.y() * height).norm();
+    float rho_y = Vec2(dy.x() * width, dy.y() * height).norm();
+    return log2(max({ rho_x, rho_y, 1e-8f }));
+}
+
+Vec3 Texture::sample(float u, float v, float lod) const {
+    u = std::clamp(u, 0.0f, 1.0f);
+    v = std::clamp(v, 0.0f, 1.0f);
+
+    // magnification and the smallest level are plain bilinear lookups
+    int last = (int)mip_levels.size() - 1;
+    if (!(lod > 0.0f))
+        return bilinear_fn(mip_levels[0], u, v);
+    if (lod >= last)
+        return bilinear_fn(mip_levels[last], u, v);
+
+    int level = (int)lod;
+    float t = lod - level;
+    Vec3 fine = bilinear_fn(mip_levels[level], u, v);
+    if (t == 0.0f)
+        return fine;
+    return fine + (bilinear_fn(mip_levels[level + 1], u, v) - fine) * t;
 }
 
 int Texture::w() const {
@@ -32,4 +199,48 @@ int Texture::w() const {
 
 int Texture::h() const {
     return height;
-}
\ No newline at end of file
+}
+
+TextureFormat Texture::format() const {
+    return texel_format;
+}
+
+TextureLayout Texture::layout() const {
+    return texel_layout;
+}
+
+int Texture::levels() const {
+    return (int)mip_levels.size();
+}
+
+cv::Size Texture::levelSize(int level) const {
+    return cv::Size(mip_levels[level].width, mip_levels[level].height);
+}
+
+const uchar* Texture::texelAddress(int level, int x, int y) const {
+    const MipLevel& l = mip_levels[level];
+    size_t texel_size = l.texels.elemSize();
+    if (texel_layout == TextureLayout::Tiled)
+        return l.texels.ptr<uchar>(y / TEXTURE_TILE)
+            + ((x / TEXTURE_TILE * TEXTURE_TILE + y % TEXTURE_TILE) * TEXTURE_TILE + x % TEXTURE_TILE) * texel_size;
+    return l.texels.ptr<uchar>(y) + x * texel_size;
+}
+
+cv::Mat Texture::image(int level) const {
+    const MipLevel& l = mip_levels[level];
+    if (texel_layout == TextureLayout::Linear)
+        return l.texels.clone();
+    cv::Mat result(l.height, l.width, l.texels.type());
+    size_t texel_size = l.texels.elemSize();
+    for (int y = 0; y < l.height; y++)
+        for (int x = 0; x < l.width; x++)
+            memcpy(result.ptr<uchar>(y) + x * texel_size, texelAddress(level, x, y), texel_size);
+    return result;
+}
+
+size_t Texture::memoryBytes() const {
+    size_t bytes = 0;
+    for (const MipLevel& level : mip_levels)
+        bytes += level.texels.total() * level.texels.elemSize();
+    return bytes;
+}
@@ -3,6 +3,7 @@
 
 #include <Eigen/Eigen>
 #include <opencv2/opencv.hpp>
+#include <vector>
 
 using namespace std;
 using Vec2 = Eigen::Vector2f;
@@ -12,18 +13,62 @@ using Mat2 = Eigen::Matrix2f;
 using Mat3 = Eigen::Matrix3f;
 using Mat4 = Eigen::Matrix4f;
 
+// storage of the texels, chosen at load time; every format is sampled as floats in [0, 1]
+enum class TextureFormat {
+    RGBA8,   // 4 x 8 bit per texel, one aligned 32-bit load
+    RGBA32F, // 4 x float per texel, no conversion on fetch
+    R8       // 1 x 8 bit per texel for scalar maps, returned in all three components
+};
+
+// order of the texels in memory
+enum class TextureLayout {
+    Linear, // row by row
+    Tiled   // 4x4 blocks of texels stored together (one cache line in RGBA8), blocks row by row
+};
+
 class Texture {
 public:
-    Texture(const string& filename);
+    Texture(const string& filename, TextureFormat format = TextureFormat::RGBA8, TextureLayout layout = TextureLayout::Linear);
+    Texture(const cv::Mat& image, TextureFormat format = TextureFormat::RGBA8, // RGB image, 8 bits per channel
+        TextureLayout layout = TextureLayout::Linear);
     
     int w() const;
     int h() const;
+    TextureFormat format() const;
+    TextureLayout layout() const;
+
+    Vec3 getColor(float u, float v) const; // nearest texel of the full resolution image
 
-    Vec3 getColor(float u, float v) const;
+    // mip level for a pixel whose texture coordinates change by dx / dy from one pixel to the next
+    float lod(const Vec2& dx, const Vec2& dy) const;
+    // bilinear filtering inside a mip level, trilinear between the two levels around lod
+    Vec3 sample(float u, float v, float lod) const;
+
+    // level 0 is the full resolution image, each level halves the size
+    int levels() const;
+    cv::Size levelSize(int level) const;
+    const uchar* texelAddress(int level, int x, int y) const; // where texel (x, y) of the level is stored
+    cv::Mat image(int level) const; // copy of the level in the storage format, row by row
+    size_t memoryBytes() const;     // texel memory of all levels
+
+    struct MipLevel {
+        cv::Mat texels; // Linear: one image row per row; Tiled: one row of 4x4 blocks per row, padded to whole blocks
+        int width, height;
+    };
 
 private:
-    cv::Mat image_data;
+    vector<MipLevel> mip_levels;
     int width, height;
+    TextureFormat texel_format;
+    TextureLayout texel_layout;
+
+    // lookups specialized for the format and layout, picked at load time
+    Vec3 (*texel_fn)(const MipLevel& level, int x, int y);
+    Vec3 (*bilinear_fn)(const MipLevel& level, float u, float v);
+
+    void convert(const cv::Mat& rgb);
+    void buildMipmaps();
+    void selectLookups();
 };
 
-#endif
\ No newline at end of file
+#endif
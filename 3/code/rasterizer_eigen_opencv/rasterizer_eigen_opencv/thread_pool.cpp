@@ -0,0 +1,87 @@
+#include "thread_pool.hpp"
+#include <algorithm>
+
+ThreadPool::ThreadPool(int thread_count) :
+	job_fn(nullptr), job_count(0), next_index(0), finished_workers(0), generation(0), stopping(false) {
+	if (thread_count <= 0)
+		thread_count = max(1, (int)thread::hardware_concurrency());
+
+	// the thread calling parallelFor also executes jobs, so spawn one worker less
+	for (int i = 0; i < thread_count - 1; i++)
+		workers.emplace_back(&ThreadPool::workerLoop, this);
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		lock_guard<mutex> lock(mtx);
+		stopping = true;
+	}
+	start_cv.notify_all();
+	for (auto& worker : workers)
+		worker.join();
+}
+
+int ThreadPool::size() const {
+	return (int)workers.size() + 1;
+}
+
+void ThreadPool::runJobs(const function<void(int)>& job, int count) {
+	int i;
+	while ((i = next_index.fetch_add(1)) < count)
+		job(i);
+}
+
+void ThreadPool::workerLoop() {
+	unsigned long long seen_generation = 0;
+	while (true) {
+		const function<void(int)>* job;
+		int count;
+		{
+			unique_lock<mutex> lock(mtx);
+			start_cv.wait(lock, [&] { return stopping || generation != seen_generation; });
+			if (stopping)
+				return;
+			seen_generation = generation;
+			job = job_fn;
+			count = job_count;
+		}
+
+		runJobs(*job, count);
+
+		{
+			lock_guard<mutex> lock(mtx);
+			finished_workers++;
+		}
+		done_cv.notify_one();
+	}
+}
+
+void ThreadPool::parallelFor(int count, const function<void(int)>& job) {
+	if (count <= 0)
+		return;
+
+	// nothing to share, skip the wake-up round trip
+	if (workers.empty() || count == 1) {
+		for (int i = 0; i < count; i++)
+			job(i);
+		return;
+	}
+
+	{
+		lock_guard<mutex> lock(mtx);
+		job_fn = &job;
+		job_count = count;
+		next_index = 0;
+		finished_workers = 0;
+		generation++;
+	}
+	start_cv.notify_all();
+
+	runJobs(job, count);
+
+	// every worker takes part in every round, so once all of them checked out
+	// no thread can still touch this job
+	unique_lock<mutex> lock(mtx);
+	done_cv.wait(lock, [&] { return finished_workers == (int)workers.size(); });
+	job_fn = nullptr;
+}
@@ -0,0 +1,46 @@
+#ifndef RASTERIZER_THREAD_POOL_H
+#define RASTERIZER_THREAD_POOL_H
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+
+using namespace std;
+
+// Fixed-size pool of worker threads, used to split per-frame work (screen tiles, rows) across cores
+class ThreadPool {
+public:
+	ThreadPool(int thread_count = 0); // 0: one thread per hardware core
+	~ThreadPool();
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	int size() const; // number of threads that execute jobs, including the calling thread
+
+	// Run job(i) for every i in [0, count) and block until all of them are finished.
+	// Indices are handed out dynamically, so uneven jobs are balanced across threads.
+	void parallelFor(int count, const function<void(int)>& job);
+
+private:
+	vector<thread> workers;
+
+	mutex mtx;
+	condition_variable start_cv;
+	condition_variable done_cv;
+
+	const function<void(int)>* job_fn;
+	int job_count;
+	atomic<int> next_index;
+	int finished_workers;          // workers done with the current round
+	unsigned long long generation; // incremented for every parallelFor call
+	bool stopping;
+
+	void workerLoop();
+	void runJobs(const function<void(int)>& job, int count);
+};
+
+#endif